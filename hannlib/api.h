@@ -2,6 +2,8 @@
 
 #include "core/base.h"
 #include "core/hybrid_hnsw.h"
+#include "core/ingestion_queue.h"
+#include "core/parallel.h"
 #include "extensions/attributes.h"
 #include "extensions/scalar.h"
 #include "extensions/spatial.h"
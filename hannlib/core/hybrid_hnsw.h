@@ -3,16 +3,25 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
 #include <list>
+#include <memory>
+#include <numeric>
 #include <random>
+#include <shared_mutex>
 #include <sstream>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "base.h"
 #include "optimizer.h"
+#include "parallel.h"
 #include "visited_list_pool.h"
 
 namespace hannlib
@@ -28,10 +37,23 @@ enum SearchStrategy
   kCBO             = 3
 };
 
+// Tags of the optional sections appended to a saved index. Every section is
+// stored as `tag | byte size | content`, unknown tags are skipped on load.
+enum IndexSection
+{
+  kSectionTombstones = 1,
+  kSectionSlotRing   = 2,
+  kSectionPruning    = 3,
+  kSectionBuildState = 4
+};
+
 //     a node: skiplist next | (linksize + links) * n
 // a fat node: skiplist next | (linksize + links) * n | vector data | label |
 // payload
 
+static_assert(sizeof(std::atomic<tableint>) == sizeof(tableint),
+              "The skiplist links are accessed as atomics in place");
+
 struct NodePtr
 {
  protected:
@@ -40,11 +62,21 @@ struct NodePtr
  public:
   NodePtr(char *ptr) : ptr_(ptr){};
 
-  inline tableint get_skiplist_next() const { return *((tableint *)ptr_); };
+  // The skiplist next is accessed atomically, since insertions link into the
+  // skiplist concurrently
+  inline std::atomic<tableint> &skiplist_next() const
+  {
+    return *reinterpret_cast<std::atomic<tableint> *>(ptr_);
+  };
+
+  inline tableint get_skiplist_next() const
+  {
+    return skiplist_next().load(std::memory_order_acquire);
+  };
 
   inline void set_skiplist_next(tableint node_id)
   {
-    *((tableint *)ptr_) = node_id;
+    skiplist_next().store(node_id, std::memory_order_release);
   };
 
   inline const tableint *get_links(int size_per_slot, int slot_i) const
@@ -228,9 +260,14 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   HSIG(SpaceInterface<dist_t> *s, SlotRanges slot_ranges, size_t max_elements,
        size_t max_links_per_slot = 8, size_t ef_construction = 200,
        size_t random_seed = 100)
-      : element_levels_(max_elements),
+      : updated_flags_(max_elements),
+        element_levels_(max_elements),
+        deleted_flags_(max_elements),
+        slot_generations_(slot_ranges.size()),
+        moved_flags_(max_elements),
         slot_ranges_(slot_ranges),
         link_list_locks_(max_elements),
+        link_list_versions_(max_elements),
         link_list_update_locks_(max_update_element_locks),
         global_slot_locks_(slot_ranges.size())
   {
@@ -251,6 +288,7 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     ef_construction_ = std::max(ef_construction, al_);
     ef_              = 10;
 
+    random_seed_ = random_seed;
     level_generator_.seed(random_seed);
     update_probability_generator_.seed(random_seed + 1);
 
@@ -278,21 +316,12 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     visited_list_pool_ = new VisitedListPool(1, max_elements);
 
     // initializations for special treatment of the first node
-    slot_enterpoint_nodes_ =
-        (tableint *)malloc(sizeof(tableint) * num_segments_);
-    for (unsigned i = 0; i < num_segments_; i++)
-    {
-      slot_enterpoint_nodes_[i] = -1;
-    }
-
-    global_enterpoint_node_ = -1;
-    global_max_level_       = -1;
-
-    slot_maxlevels_ = (int *)malloc(sizeof(int) * num_segments_);
+    slot_entrypoints_.reset(new std::atomic<uint64_t>[num_segments_]);
     for (unsigned i = 0; i < num_segments_; i++)
     {
-      slot_maxlevels_[i] = -1;
+      SetSlotEntrypoint(i, -1, -1);
     }
+    SetGlobalEntrypoint(-1, -1);
 
     link_lists_ = (char **)malloc(sizeof(void *) * max_elements_);
     if (link_lists_ == nullptr)
@@ -319,21 +348,13 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     free(data_level0_memory_);
     for (tableint i = 0; i < cur_element_count_; i++)
     {
-      if (element_levels_[i] > 0) free(link_lists_[i]);
+      FreeElement(i);
     }
     free(link_lists_);
-    for (tableint i = 0; i < cur_element_count_; i++)
-    {
-      for (int j = 0; j < element_levels_[i]; j++)
-      {
-        delete global_link_bitmaps_[i][j];
-      }
-      free(global_link_bitmaps_[i]);
-    }
     free(global_link_bitmaps_);
+    free(link_dists_level0_);
+    free(link_dists_);
 
-    free(slot_enterpoint_nodes_);
-    free(slot_maxlevels_);
     delete visited_list_pool_;
   }
 
@@ -410,11 +431,13 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   std::priority_queue<std::pair<dist_t, labeltype>> KnnSearch(
       const void *query_data, size_t k) const
   {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
     std::priority_queue<std::pair<dist_t, labeltype>> result;
-    if (cur_element_count_ == 0) return result;
+    Entrypoint entrypoint = GetGlobalEntrypoint();
+    if (cur_element_count_ == 0 || (signed)entrypoint.id == -1) return result;
 
-    tableint curr_obj = global_enterpoint_node_;
-    int maxlevel      = global_max_level_;
+    tableint curr_obj = entrypoint.id;
+    int maxlevel      = entrypoint.level;
 
     // Number of activated links for per slot
     unsigned al_per_slot = std::floor((double)al_ / num_segments_);
@@ -424,34 +447,29 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     dist_t curdist = fstdistfunc_(query_data, GetDataByInternalId(curr_obj),
                                   dist_func_param_);
 
+    std::vector<unsigned> all_slots(num_segments_);
+    std::iota(all_slots.begin(), all_slots.end(), 0);
+    std::vector<tableint> neighbors;
     for (int level = maxlevel; level > 0; level--)
     {
       bool changed = true;
       while (changed)
       {
         changed = false;
-        for (unsigned slot_i = 0; slot_i < num_segments_;
-             slot_i++)  //找到curr_obj在level的每个slot中的最近邻
+        //找到curr_obj在level的每个slot中的最近邻
+        ReadSlotLinks(curr_obj, level, all_slots, al_per_slot, neighbors);
+        for (tableint cand : neighbors)
         {
-          const tableint *links = GetLinks(
-              curr_obj, level, slot_i);  // curr_obj在level的slot_i中的连接
-          int size             = std::min(GetLinkCount(links), al_per_slot);
-          const tableint *data = links + 1;
+          if (cand < 0 || cand > max_elements_)
+            throw std::runtime_error("cand error");
+          dist_t d = fstdistfunc_(query_data, GetDataByInternalId(cand),
+                                  dist_func_param_);
 
-          for (int j = 0; j < size; j++)
+          if (d < curdist)
           {
-            tableint cand = data[j];
-            if (cand < 0 || cand > max_elements_)
-              throw std::runtime_error("cand error");
-            dist_t d = fstdistfunc_(query_data, GetDataByInternalId(cand),
-                                    dist_func_param_);
-
-            if (d < curdist)
-            {
-              curdist  = d;
-              curr_obj = cand;
-              changed  = true;
-            }
+            curdist  = d;
+            curr_obj = cand;
+            changed  = true;
           }
         }
       }
@@ -485,6 +503,7 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   std::priority_queue<std::pair<dist_t, labeltype>> HybridFiltering(
       const void *query_data, size_t k, PayloadQuery payload_query) const
   {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
     // std::cout<<"--------HybridFiltering--------"<<std::endl;
 
     // std::cout << "Get slots\n";
@@ -520,12 +539,11 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   std::priority_queue<std::pair<dist_t, labeltype>> PreFiltering(
       const void *query_data, size_t k, PayloadQuery payload_query) const
   {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
     std::priority_queue<std::pair<dist_t, labeltype>> result;
-    if (cur_element_count_ == 0) return result;
-
-    tableint enterpoint_copy = global_enterpoint_node_;
-    int maxlevelcopy         = global_max_level_;
-    tableint cur_obj         = enterpoint_copy;
+    tableint enterpoint_copy = GetGlobalEntrypoint().id;
+    if (cur_element_count_ == 0 || (signed)enterpoint_copy == -1)
+      return result;
 
     if ((signed)enterpoint_copy == -1 || enterpoint_copy > cur_element_count_)
     {
@@ -538,19 +556,19 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
                         CompareByFirst>
         internal_results;
 
-    Scalar left          = payload_query.first;
-    bool is_head_skipped = false;
+    // Insertions link into the skiplist by CAS under a shared `global_`, while
+    // unlinking, relinking a moved payload and adding levels take it
+    // exclusively, so the walk never stands on a node being moved
+    std::shared_lock<std::shared_mutex> lock_skiplist(global_);
+
     // Find the last point whose scalar value < left in each level
-    for (int level = maxlevelcopy; level >= 0; level--)
+    Scalar left   = payload_query.first;
+    tableint pred = -1;
+    for (int level = skiplist_heads_.size() - 1; level >= 0; level--)
     {
-      if (!is_head_skipped)
-      {
-        cur_obj = skiplist_heads_[level];
-      }
-
       while (true)
       {
-        tableint next = GetSkipListNext(cur_obj, level);
+        tableint next = GetSkipListSuccessor(pred, level);
         if ((signed)next == -1)  // Reach the tail of linked list
         {
           break;
@@ -558,8 +576,7 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
         auto value = GetPayloadByInternalId(next);
         if (value < left)
         {
-          is_head_skipped = true;
-          cur_obj         = next;
+          pred = next;
         }
         else
         {
@@ -568,59 +585,28 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       }
     }
 
-    // Perform linear search in level 0
+    // Perform linear search in level 0. Deleted elements have been unlinked
+    // from the skiplist, so every visited point is a live one. Points below
+    // the range may have been linked after `pred` since it was found.
+    tableint cur_obj = GetSkipListSuccessor(pred, 0);
+    for (; (signed)cur_obj != -1; cur_obj = GetSkipListNext(cur_obj, 0))
     {
-      if (!is_head_skipped)
+      auto value = GetPayloadByInternalId(cur_obj);
+      if (value > payload_query.second)
       {
-        cur_obj = skiplist_heads_[0];
+        break;
       }
-      else
+      if (value < left) continue;
+      dist_t curdist = fstdistfunc_(query_data, GetDataByInternalId(cur_obj),
+                                    dist_func_param_);
+      if (internal_results.size() < k || curdist < internal_results.top().first)
       {
-        // cur_obj is the last point whose scalar value < left,
-        // therefore cur_obj.next should have a scalar value >= left
-        tableint next = GetSkipListNext(cur_obj, 0);
-        if ((signed)next == -1)  // Reach the tail of linked list
-        {
-          return result;
-        }
-        cur_obj = next;
+        internal_results.emplace(curdist, cur_obj);
       }
 
-      // std::cout << "Query range: [" << payload_query.first << ","
-      //           << payload_query.second << "], find entry point in level0:
-      //           id="
-      //           << GetLabelByInternalId(cur_obj)
-      //           << ", value=" << GetPayloadByInternalId(cur_obj)
-      //           << ", is_head_skipped=" << is_head_skipped << "\n";
-
-      while (true)
+      if (internal_results.size() > k)
       {
-        auto value = GetPayloadByInternalId(cur_obj);
-        if (value >= payload_query.first && value <= payload_query.second)
-        {
-          dist_t curdist = fstdistfunc_(
-              query_data, GetDataByInternalId(cur_obj), dist_func_param_);
-          if (internal_results.size() < k ||
-              curdist < internal_results.top().first)
-          {
-            internal_results.emplace(curdist, cur_obj);
-          }
-
-          if (internal_results.size() > k)
-          {
-            internal_results.pop();
-          }
-          tableint next = GetSkipListNext(cur_obj, 0);
-          if ((signed)next == -1)  // Reach the tail of linked list
-          {
-            break;
-          }
-          cur_obj = next;
-        }
-        else
-        {
-          break;
-        }
+        internal_results.pop();
       }
     }
 
@@ -642,15 +628,17 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   std::priority_queue<std::pair<dist_t, labeltype>> PostFiltering(
       const void *query_data, size_t k, PayloadQuery payload_query) const
   {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
     // std::cout << "=================================================\n";
     // std::cout << "PostFiltering: [" << payload_query.first << ","
     //           << payload_query.second << "], ef=" << ef_ << ", al=" << al_
     //           << "\n";
     std::priority_queue<std::pair<dist_t, labeltype>> result;
-    if (cur_element_count_ == 0) return result;
+    Entrypoint entrypoint = GetGlobalEntrypoint();
+    if (cur_element_count_ == 0 || (signed)entrypoint.id == -1) return result;
 
-    tableint curr_obj = global_enterpoint_node_;
-    int maxlevel      = global_max_level_;
+    tableint curr_obj = entrypoint.id;
+    int maxlevel      = entrypoint.level;
 
     // std::cout << "Graph entry point: " << curr_obj << "\n";
     // std::cout << "al_per_slot: " << al_per_slot << "\n";
@@ -658,6 +646,7 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     dist_t curdist = fstdistfunc_(query_data, GetDataByInternalId(curr_obj),
                                   dist_func_param_);
 
+    std::vector<tableint> neighbors;
     for (int level = maxlevel; level > 0; level--)
     {
       bool changed = true;
@@ -665,17 +654,10 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       {
         changed = false;
 
-        const tableint *linklist =
-            GetLinks(curr_obj, level, 0);  // curr_obj在level的全部链表
-        const Bitmap &bitmap = *global_link_bitmaps_[curr_obj][level];
-        for (unsigned j = 0; j < bitmap.size(); j++)
+        // curr_obj在level的全部链表中被bitmap选中的连接
+        ReadGlobalLinks(curr_obj, level, neighbors);
+        for (tableint cand : neighbors)
         {
-          if (!bitmap[j])
-          {
-            continue;
-          }
-
-          tableint cand = linklist[j];
           if (cand < 0 || cand > max_elements_)
             throw std::runtime_error("cand error");
           dist_t d = fstdistfunc_(query_data, GetDataByInternalId(cand),
@@ -736,7 +718,10 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   tableint Insert(const void *data_point, labeltype label, Payload payload,
                   int level)
   {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
     tableint cur_c = 0;
+    bool is_reused = false;
+    int curlevel;
     {
       // Checking if the element with the same label already exists
       // if so, throw a runtime exception
@@ -745,18 +730,43 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       auto search = label_lookup_.find(label);
       if (search != label_lookup_.end())
       {
-        throw std::runtime_error("The inserted element already exists");
+        // The element already exists: replace its vector in place
+        tableint existing_id = search->second;
+        templock_curr.unlock();
+
+        if (IsMarkedDeleted(existing_id))
+        {
+          UnmarkDeleteInternal(existing_id);
+        }
+        if (GetPayloadByInternalId(existing_id) != payload)
+        {
+          UpdatePayloadInternal(existing_id, payload);
+        }
+        UpdatePoint(data_point, existing_id, 1.0);
+        return existing_id;
       }
 
-      if (cur_element_count_ >= max_elements_)
+      if (!free_ids_.empty())
       {
-        throw std::runtime_error(
-            "The number of elements exceeds the specified limit");
-      };
+        // Reuse the id of a retired element
+        cur_c = free_ids_.back();
+        free_ids_.pop_back();
+        is_reused = true;
+      }
+      else
+      {
+        if (cur_element_count_ >= max_elements_)
+        {
+          throw std::runtime_error(
+              "The number of elements exceeds the specified limit");
+        };
 
-      cur_c = cur_element_count_;  // cur_c是data_point的id
-      cur_element_count_++;
+        cur_c = cur_element_count_;  // cur_c是data_point的id
+        cur_element_count_++;
+      }
       label_lookup_[label] = cur_c;
+      curlevel             = GetNewElementLevel(label);
+      if (level > 0) curlevel = level;
     }
 
     // Take update lock to prevent race conditions on an element with
@@ -768,366 +778,715 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     std::unique_lock<std::mutex> lock_el(link_list_locks_[cur_c]);
     // PrintLockState(cur_c, -1, "got", "links", cur_c);
 
-    int curlevel = GetRandomLevel(mult_);
-    if (level > 0) curlevel = level;
-
-    element_levels_[cur_c] = curlevel;  //每个数据所在的层
-
-    FatNodePtr cur_fat_node =
-        GetFatNodePtrLevel0(cur_c);  //该数据（节点）在大图的第0层的地址
-    cur_fat_node.Clear(size_fat_node_level0_);  //将这块地址的内存区清空
-
-    // Initialisation of the data, label, and payload
-    cur_fat_node.set_label(label_offset_, label);
-    cur_fat_node.set_payload(payload_offset_, payload);
-    cur_fat_node.set_data(data_offset_, data_point,
-                          data_size_);  //将data_point插入到第0层
-
-    // PrintFatNode(cur_c);
-
-    if (curlevel > 0)
+    if (is_reused)
     {
-      link_lists_[cur_c] = (char *)malloc(size_node_ * curlevel +
-                                          1);  // size_node_:所有slot的大小
-      if (link_lists_[cur_c] == nullptr)
-        throw std::runtime_error(
-            "Not enough memory: Insert failed to allocate linklist");
-      memset(link_lists_[cur_c], 0, size_node_ * curlevel + 1);
-      // PrintNode(cur_c, curlevel);
+      FreeElement(cur_c);
+      deleted_flags_[cur_c] = false;
+      updated_flags_[cur_c] = false;
     }
 
+    InitElement(cur_c, data_point, label, payload, curlevel);
+
     unsigned cur_c_slot = QueryExtension::ComputeSlotIdx(
         payload, slot_ranges_);  //根据一维数值计算对应的slote的ID
 
     // Add skiplist connections
+    bool is_new_top;
     {
-      // This lock is used to prevent race contitions for
-      // global_enterpoint_node_, global_max_level, and all skiplist links.
-      std::unique_lock<std::mutex> templock(global_);
-
-      tableint enterpoint_copy = global_enterpoint_node_;
-      int maxlevelcopy         = global_max_level_;
-      tableint cur_obj         = enterpoint_copy;
+      // Insertions link into the skiplist concurrently by CAS, holding this
+      // lock shared. It is held exclusively to unlink points, to add skiplist
+      // levels, and to update the global entry point.
+      std::shared_lock<std::shared_mutex> templock(global_);
+      if ((int)skiplist_heads_.size() <= curlevel)
+      {
+        templock.unlock();
+        {
+          std::unique_lock<std::shared_mutex> templock_levels(global_);
+          if ((int)skiplist_heads_.size() <= curlevel)
+            skiplist_heads_.resize(curlevel + 1, -1);
+        }
+        templock.lock();
+      }
 
-      if ((signed)enterpoint_copy != -1 && enterpoint_copy > cur_element_count_)
+      Entrypoint entrypoint = GetGlobalEntrypoint();
+      if ((signed)entrypoint.id != -1 && entrypoint.id > cur_element_count_)
       {
         throw std::runtime_error(std::string("enterpoint error: ") +
-                                 std::to_string(enterpoint_copy));
+                                 std::to_string(entrypoint.id));
       }
+      is_new_top = curlevel > entrypoint.level;
 
-      // The inserted object is not the first object
-      if ((signed)cur_obj != -1)
-      {
-        bool is_head_skipped = false;
-        // 找到最后一个值小于当前插入节点值的节点
-        for (int level = global_max_level_; level >= curlevel; level--)
-        {
-          if (!is_head_skipped)
-          {
-            cur_obj = skiplist_heads_[level];
-            // 头节点的值比当前插入节点的值小，那么它会被跳过，否则就不会被跳过
-            auto value = GetPayloadByInternalId(cur_obj);
-            if (value < payload)
-            {
-              is_head_skipped = true;
-            }
-          }
+      LinkSkipList(cur_c, curlevel, payload);
+    }
 
-          while (true)
-          {
-            tableint next = GetSkipListNext(cur_obj, level);
-            if ((signed)next == -1)  // Reach the tail of linked list
-            {
-              break;
-            }
-            auto value = GetPayloadByInternalId(next);
-            if (value < payload)
-            {
-              is_head_skipped = true;
-              cur_obj         = next;
-            }
-            else
-            {
-              break;
-            }
-          }
-        }
+    // The current object level is larger than the maximum level (always true
+    // for the first object): update the global entry point and max level
+    if (is_new_top)
+    {
+      std::unique_lock<std::shared_mutex> templock(global_);
+      if (curlevel > GetGlobalEntrypoint().level)
+        SetGlobalEntrypoint(cur_c, curlevel);
+    }
 
-        // Insert the new point to all layers < curlevel
-        for (int level = std::min(curlevel, maxlevelcopy); level >= 0; level--)
-        {
-          if (level > maxlevelcopy || level < 0)  // possible?
-          {
-            throw std::runtime_error("Level error");
-          }
+    if (insert_pool_)
+    {
+      // The slots are linked concurrently, so the lock of the element is only
+      // taken to write its own lists, which may meanwhile get reverse links
+      lock_el.unlock();
+      insert_pool_->ParallelFor(0, num_segments_,
+                                [&](size_t slot_i)
+                                {
+                                  LinkElementSlot(cur_c, data_point, curlevel,
+                                                  cur_c_slot, slot_i, false);
+                                });
+    }
+    else
+    {
+      LinkElement(cur_c, data_point, curlevel, cur_c_slot);
+      lock_el.unlock();
+    }
 
-          if (!is_head_skipped)
-          {
-            cur_obj = skiplist_heads_[level];
-            // 头节点的值比当前插入节点的值小，那么它会被跳过，否则就不会被跳过
-            auto value = GetPayloadByInternalId(cur_obj);
-            if (value < payload)
-            {
-              is_head_skipped = true;
-            }
-          }
+    // Compute bitmap for overall graph links
+    if (!defer_global_links_) PruneGlobalLinks(cur_c, curlevel);
+    return cur_c;
+  };
 
-          while (true)
-          {
-            tableint next = GetSkipListNext(cur_obj, level);
-            if ((signed)next == -1)  // Reach the tail of linked list
-            {
-              break;
-            }
-            auto value = GetPayloadByInternalId(next);
-            if (value < payload)
-            {
-              is_head_skipped = true;
-              cur_obj         = next;
-            }
-            else
-            {
-              break;
-            }
-          }
+  /*
+   * Bulk load into an empty index. `data` holds the `n` vectors contiguously.
+   * The levels of all the elements are drawn first, and the payload skiplist
+   * is built in a single pass over the elements sorted by payload, instead of
+   * one descent per element; then the elements are linked into the graph in
+   * order, as `Insert` does.
+   *
+   * With several threads, the graph is built batch-synchronously, per slot
+   * rather than per element. A batch at most doubles the size of every slot,
+   * up to `batch_size` elements, so that the first elements of a slot are
+   * linked to each other. For each batch:
+   *   1. the (slot, part of the batch) pairs are scheduled over the threads,
+   *      with about `num_threads` parts per batch across all the slots. They
+   *      only write the lists of the new elements, and collect the reverse
+   *      links;
+   *   2. the reverse links are grouped by target list, and each list merges
+   *      all of its new links with a single heuristic run, in parallel;
+   *   3. the global links of the new elements and of the changed targets are
+   *      recomputed.
+   * No list is contended in the first step, and no list is written twice in
+   * the second one. As the searches of a batch only see the elements of the
+   * former batches, the resulting index does not depend on the number of
+   * threads, see `set_deterministic_build`. An interrupted build can be
+   * resumed from a checkpoint, see `set_checkpoint`.
+   */
+  void InsertBatch(const void *data, const labeltype *labels,
+                   const Payload *payloads, size_t n, size_t num_threads = 1,
+                   size_t batch_size = 4096)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+    num_threads = std::max<size_t>(1, num_threads);
+    InitBatch(data, labels, payloads, n);
+    num_unlinked_     = n;
+    build_threads_    = num_threads;
+    build_batch_size_ = num_threads == 1 && !deterministic_build_
+                            ? 0
+                            : std::max<size_t>(1, batch_size);
+    LinkBatch(num_threads);
+  }
 
-          if (is_head_skipped)
-          {
-            tableint old_next = GetSkipListNext(cur_obj, level);
-            SetSkipListNext(cur_obj, level, cur_c);
-            SetSkipListNext(cur_c, level, old_next);
-          }
-          else
-          {
-            tableint old_next      = skiplist_heads_[level];
-            skiplist_heads_[level] = cur_c;
-            SetSkipListNext(cur_c, level, old_next);
-          }
-        }
+  // Finishes the bulk load of a checkpoint loaded by `LoadIndex`, see
+  // `set_checkpoint`. The checkpoint keeps the batch size of the interrupted
+  // `InsertBatch` and whether it was serial, so the index is the same as
+  // without interruption, whatever the number of threads of the batches.
+  // 0 threads means as many as the interrupted build.
+  void ResumeInsertBatch(size_t num_threads = 0)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    LinkBatch(num_threads == 0 ? build_threads_ : num_threads);
+  }
+
+  /*
+   * Recomputes the global link bitmaps of all the elements, in parallel. The
+   * bitmap of an element only depends on its own slot links, so a build with
+   * `set_defer_global_links(true)` needs a single pass at the end, instead of
+   * recomputing the bitmaps of the neighbors along every insertion.
+   */
+  void ComputeGlobalLinks(size_t num_threads = 0)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    ParallelFor(0, cur_element_count_, num_threads,
+                [&](size_t id, size_t)
+                {
+                  std::unique_lock<std::mutex> lock(link_list_locks_[id]);
+                  if (global_link_bitmaps_[id] == nullptr) return;
+                  for (int level = 0; level <= element_levels_[id]; level++)
+                  {
+                    RefreshGlobalLinks(id, level);
+                  }
+                });
+  }
+
+  /*
+   * Bulk load into an empty index as `InsertBatch`, but without searching the
+   * graph: at every level, the nearest elements of every slot to every
+   * element are approximated by NN-Descent (Dong et al., WWW 2011), with one
+   * bounded list of `num_candidates` candidates per element and slot (0 means
+   * M). The neighbors and reverse neighbors of an element are joined
+   * pairwise, and every pair improves the candidates of both elements for the
+   * slot of the other one. Then the links of every slot are selected by the
+   * heuristic among the candidates and the reverse candidates.
+   *
+   * The joins stop after `num_iterations`, or once less than
+   * `min_update_rate` of the candidates changed in an iteration. The
+   * candidates take about 12 * S * `num_candidates` bytes per element. As the
+   * joins run concurrently, the index depends on the number of threads.
+   */
+  void BuildByNNDescent(const void *data, const labeltype *labels,
+                        const Payload *payloads, size_t n,
+                        size_t num_threads = 0, size_t num_candidates = 0,
+                        size_t num_iterations = 10,
+                        float min_update_rate = 0.001f)
+  {
+    if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+    num_threads = std::max<size_t>(1, num_threads);
+    if (num_candidates == 0) num_candidates = max_links_per_slot_;
+
+    {
+      std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+      InitBatch(data, labels, payloads, n);
+      if (n == 0) return;
+
+      std::vector<unsigned> elem_slots(n);
+      for (tableint id = 0; id < n; id++)
+      {
+        elem_slots[id] =
+            QueryExtension::ComputeSlotIdx(payloads[id], slot_ranges_);
       }
-      else
+
+      for (int level = 0; level <= GetGlobalEntrypoint().level; level++)
       {
-        // Do nothing for the first element
-        global_enterpoint_node_ = cur_c;
-        global_max_level_       = curlevel;
-        skiplist_heads_.resize(curlevel + 1);
-        for (int level = 0; level <= curlevel; level++)
+        std::vector<tableint> nodes;
+        for (tableint id = 0; id < n; id++)
         {
-          skiplist_heads_[level] = cur_c;
-          SetSkipListNext(cur_c, level, -1);
+          if (element_levels_[id] >= level) nodes.push_back(id);
         }
+        std::vector<NNDescentCandidate> pool = NNDescentLevel(
+            nodes, elem_slots, num_candidates, num_threads, num_iterations,
+            min_update_rate);
+        LinkNNDescentLevel(nodes, elem_slots, level, num_candidates, pool,
+                           num_threads);
       }
 
-      // The current object level is larger than the maximum level, and
-      // the inserted object is not the first object
-      if (curlevel > maxlevelcopy && (signed)cur_obj != -1)
+      for (tableint id = 0; id < n; id++)
       {
-        // Update the global entry point and max level
-        global_enterpoint_node_ = cur_c;
-        global_max_level_       = curlevel;
-
-        skiplist_heads_.resize(curlevel + 1);
-        for (int level = maxlevelcopy + 1; level <= curlevel; level++)
-        {
-          skiplist_heads_[level] = cur_c;
-          SetSkipListNext(cur_c, level, -1);
-        }
+        unsigned slot_i       = elem_slots[id];
+        Entrypoint entrypoint = GetSlotEntrypoint(slot_i);
+        if ((signed)entrypoint.id == -1 ||
+            element_levels_[id] > entrypoint.level)
+          SetSlotEntrypoint(slot_i, id, element_levels_[id]);
       }
     }
 
-    // Add connections for every slot
-    for (tableint slot_i = 0; slot_i < num_segments_; slot_i++)
+    if (!defer_global_links_) ComputeGlobalLinks(num_threads);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  /// Methods for element deletion
+  ///////////////////////////////////////////////////////////////////////////////
+
+  /*
+   * Marks an element as deleted. The element is never returned by the searches
+   * anymore, but its links are kept so that it is still used for routing in
+   * the graph. It is unlinked from the payload skiplist.
+   */
+  void MarkDelete(labeltype label)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    // Lock order: global_ -> cur_element_count_guard_
+    std::unique_lock<std::shared_mutex> templock(global_);
+    tableint internal_id = GetInternalIdByLabel(label);
     {
-      // PrintLockState(cur_c, slot_i, "waiting", "global", -1);
-      std::unique_lock<std::mutex> templock(global_slot_locks_[slot_i]);
-      // PrintLockState(cur_c, slot_i, "got", "global", -1);
+      std::unique_lock<std::mutex> lock_table(cur_element_count_guard_);
+      if (IsMarkedDeleted(internal_id))
+        throw std::runtime_error("The element is already marked deleted");
+      deleted_flags_[internal_id] = true;
+      num_deleted_ += 1;
+    }
+    UnlinkSkipList(internal_id);
+  }
 
-      tableint enterpoint_copy =
-          slot_enterpoint_nodes_[slot_i];  // slot_i中的入口点
-      int maxlevelcopy =
-          slot_maxlevels_[slot_i];  // slot_i中入口点所在的层次，即最高层次
-      tableint cur_obj = enterpoint_copy;
+  /*
+   * Revives an element marked deleted: it can be returned by the searches
+   * again and is linked back into the payload skiplist.
+   */
+  void UnmarkDelete(labeltype label)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    UnmarkDeleteInternal(GetInternalIdByLabel(label));
+  }
 
-      // The current object level is not larger than the maximum level, and
-      // the inserted object is not the first object of slot_i
-      if (curlevel <= maxlevelcopy && (signed)cur_obj != -1)
-      {
-        templock.unlock();
-        // PrintLockState(cur_c, slot_i, "release", "global", -1);
-      }
+  void UnmarkDeleteInternal(tableint internal_id)
+  {
+    std::unique_lock<std::shared_mutex> templock(global_);
+    {
+      std::unique_lock<std::mutex> lock_table(cur_element_count_guard_);
+      if (!IsMarkedDeleted(internal_id))
+        throw std::runtime_error("The element is not marked deleted");
+      deleted_flags_[internal_id] = false;
+      num_deleted_ -= 1;
+    }
+    LinkSkipList(internal_id, element_levels_[internal_id],
+                 GetPayloadByInternalId(internal_id));
+  }
 
-      if ((signed)cur_obj != -1)  // slot_i中已经有入口点
-      {
-        cur_fat_node = GetFatNodePtrLevel0(cur_obj);  //第0层
+  inline bool IsMarkedDeleted(tableint internal_id) const
+  {
+    return deleted_flags_[internal_id];
+  }
 
-        if (curlevel < maxlevelcopy)
-        {
-          // Perform nn search in layers > curlevel
-          dist_t curdist = fstdistfunc_(
-              data_point, cur_fat_node.get_data_ptr(data_offset_),
-              dist_func_param_);  // data_point是当前的插入点，和slot_i中的入口点计算距离
-          for (
-              int level = maxlevelcopy; level > curlevel;
-              level--)  // curlevel相当于插入点在大图上的层次，在所有的slot中该节点都在curlevel这一层
-          {  //如果data_point的范围不在这个slot_i中呢？还会被插入到slot_i中吗？(存放的不是数据本身，而是在该slot_i上和当前插入点的连接)
-            //在这里应该是添加的data_point在这个slot_i中的邻节点连接
-            //在slot中找最近邻
-            bool changed = true;
-            while (
-                changed)  //从当前最近邻的连接中找到最近邻，然后再通过该最近邻的连接找
-            {
-              changed = false;
-              // PrintLockState(cur_c, slot_i, "waiting", "links", cur_obj);
-              std::unique_lock<std::mutex> lock(link_list_locks_[cur_obj]);
-              // PrintLockState(cur_c, slot_i, "waiting", "links", cur_obj);
-
-              const tableint *links =
-                  GetLinks(cur_obj, level,
-                           slot_i);  //返回的是在slot_i中入口点存放link的指针
-              tableint link_count = GetLinkCount(
-                  links);  // links中第一个是sizeof(tableint)，应该是目前的数量，后面是具体的数据
-              const tableint *data = links + 1;  //加1跳过数量，直接取数据
-
-              for (tableint i = 0; i < link_count;
-                   i++)  //对于当前的最近邻cur_obj（第一次是入口点）的所有连接
-              {
-                tableint cand = data[i];
+  ////////////////////////////////////////////////////////////////////////////////
+  /// Methods for payload update
+  ///////////////////////////////////////////////////////////////////////////////
 
-                // Do not include the new inserted point itself as its kNN
-                if (cand == cur_c) continue;
+  /*
+   * Changes the payload of an element without inserting it again. The element
+   * is relocated in the payload skiplist. If its slot changes, the neighbors
+   * around it move their links to it from the lists of the old slot to the
+   * lists of the new slot, and the entry points of both slots are fixed.
+   *
+   * The incoming links are found from the neighborhood of the element, so a
+   * few links to it may remain in the lists of the old slot. They are only
+   * used for routing: searches check the payloads of their results and the
+   * insertions never link to an element out of the slot being searched.
+   */
+  void UpdatePayload(labeltype label, Payload payload)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    UpdatePayloadInternal(GetInternalIdByLabel(label), payload);
+  }
 
-                if (cand < 0 || cand > max_elements_)
-                  throw std::runtime_error("cand error");
-                dist_t d = fstdistfunc_(data_point, GetDataByInternalId(cand),
-                                        dist_func_param_);
-                if (d < curdist)
-                {
-                  curdist = d;
-                  cur_obj = cand;  // cur_obj是当前的最近邻
-                  changed = true;  //更新了最近邻
-                }
-              }
-            }
-          }
-        }
+  void UpdatePayloadInternal(tableint internal_id, Payload payload)
+  {
+    std::unique_lock<std::mutex> lock_el_update(
+        link_list_update_locks_[(internal_id & (max_update_element_locks - 1))]);
 
-        for (int level = std::min(curlevel, maxlevelcopy); level >= 0; level--)
-        {
-          if (level > maxlevelcopy || level < 0)  // possible?
-            throw std::runtime_error("Level error");
+    int elem_level = element_levels_[internal_id];
+    unsigned old_slot;
+    unsigned new_slot =
+        QueryExtension::ComputeSlotIdx(payload, slot_ranges_);
+    {
+      // Lock order: element -> global_, as in `Insert`, which holds the lock
+      // of the element until it is linked
+      std::unique_lock<std::mutex> lock(link_list_locks_[internal_id]);
+      std::unique_lock<std::shared_mutex> templock(global_);
+      Payload old_payload = GetPayloadByInternalId(internal_id);
+      if (old_payload == payload) return;
+      old_slot = QueryExtension::ComputeSlotIdx(old_payload, slot_ranges_);
+
+      bool is_linked = !IsMarkedDeleted(internal_id);
+      if (is_linked) UnlinkSkipList(internal_id);
+      GetMutableFatNodePtrLevel0(internal_id)
+          .set_payload(payload_offset_, payload);
+      if (is_linked) LinkSkipList(internal_id, elem_level, payload);
+    }
 
-          std::priority_queue<std::pair<dist_t, tableint>,
-                              std::vector<std::pair<dist_t, tableint>>,
-                              CompareByFirst>
-              top_candidates = SearchLayerSlotForInsertion(  // level层的结果集
-                  cur_obj, data_point, cur_c, level,
-                  slot_i);  // cur_obj:data_point的最近邻，data_point:插入点，cur_c:插入点的id
+    // The lists of the element itself are grouped by the slots of its
+    // neighbors, so only the lists linking to it are affected
+    if (old_slot == new_slot) return;
+    moved_flags_[internal_id] = true;
 
-          if (!top_candidates.empty())
-          {
-            cur_obj =
-                MutuallyConnectNewElement(  // cur_obj是next_closet_point，相当于下一层的入口点
-                    slot_i, data_point, cur_c, cur_c_slot, top_candidates,
-                    level);  // slot_i和cur_c_slot中不一定一样，是data_point在slot_i中的最近邻集合
-          }
+    for (int level = 0; level <= elem_level; level++)
+    {
+      std::unordered_set<tableint> neighbors;
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        for (tableint el : GetConnectionsWithLock(internal_id, level, slot_i))
+        {
+          neighbors.insert(el);
         }
       }
-      else
-      {
-        /* There are no points in slot_i now. */
 
-        // Do nothing for the first element of slot_i
-        if (slot_i == cur_c_slot)
+      for (tableint neigh : neighbors)
+      {
+        std::unique_lock<std::mutex> lock(link_list_locks_[neigh]);
+        tableint *ll_old = GetMutableLinks(neigh, level, old_slot);
+        size_t sz_old    = GetLinkCount(ll_old);
+        tableint *data   = ll_old + 1;
+        tableint *pos    = std::find(data, data + sz_old, internal_id);
+        if (pos == data + sz_old) continue;
+
+        // Keep the remaining links ordered
         {
-          slot_enterpoint_nodes_[slot_i] = cur_c;
-          slot_maxlevels_[slot_i]        = curlevel;
+          LinkListWriteScope write_scope(link_list_versions_[neigh]);
+          dist_t *dists = GetMutableLinkDists(neigh, level, old_slot);
+          if (dists)
+          {
+            dist_t *dist_pos = dists + 1 + (pos - data);
+            std::copy(dist_pos + 1, dists + 1 + sz_old, dist_pos);
+          }
+          std::copy(pos + 1, data + sz_old, pos);
+          SetLinkCount(ll_old, sz_old - 1);
         }
+
+        AddReverseLink(neigh, internal_id, new_slot, level);
+        RefreshGlobalLinks(neigh, level);
       }
+    }
 
-      if (curlevel > maxlevelcopy && slot_i == cur_c_slot)
+    // Fix the entry points of the slots
+    {
+      std::unique_lock<std::mutex> templock(global_slot_locks_[new_slot]);
+      Entrypoint entrypoint = GetSlotEntrypoint(new_slot);
+      if ((signed)entrypoint.id == -1 || elem_level > entrypoint.level)
+        SetSlotEntrypoint(new_slot, internal_id, elem_level);
+    }
+    {
+      std::shared_lock<std::shared_mutex> templock(global_);
+      std::unique_lock<std::mutex> templock_slot(global_slot_locks_[old_slot]);
+      if (GetSlotEntrypoint(old_slot).id == internal_id)
       {
-        slot_enterpoint_nodes_[slot_i] = cur_c;
-        slot_maxlevels_[slot_i]        = curlevel;
+        tableint ep = FindSlotEnterpoint(old_slot);
+        SetSlotEntrypoint(old_slot, ep,
+                          (signed)ep == -1 ? -1 : element_levels_[ep]);
       }
-
-      // PrintLockState(cur_c, slot_i, "release", "global", -1);
     }
-
-    // Compute bitmap for overall graph links
-    PruneGlobalLinks(cur_c, curlevel);
-    return cur_c;
-  };
+  }
 
   ////////////////////////////////////////////////////////////////////////////////
-  /// Methods for save/load index
+  /// Methods for consolidation
   ///////////////////////////////////////////////////////////////////////////////
 
-  void SaveIndex(const std::string &location)
+  /*
+   * Removes the elements marked deleted from the graph in two phases:
+   *   1. the live elements linking to deleted ones replace them by the
+   *      neighbors of the deleted ones and prune their lists by the heuristic,
+   *      as in FreshDiskANN. It only takes the locks of single elements, so
+   *      searches and insertions go on, and it can be run step by step with
+   *      `RepairDeletedLinks`;
+   *   2. `CompactDeletedElements` removes the deleted elements and renumbers
+   *      the remaining ones densely, so that their ids are reused by the next
+   *      insertions. It blocks the other operations for one pass over the
+   *      links.
+   */
+  void ConsolidateDeletions(size_t repair_batch_size = 1024)
   {
-    std::ofstream output(location, std::ios::binary);
-    std::streampos position;
-    WriteBinaryPOD(output, ef_construction_);
-    WriteBinaryPOD(output, max_links_per_slot_);
-    WriteBinaryPOD(output, max_links_per_slot_level0_);
-    WriteBinaryPOD(output, size_per_slot_level0_);
-    WriteBinaryPOD(output, num_segments_);
-    WriteBinaryVector(output, slot_ranges_);
-    WriteBinaryPOD(output, max_elements_);
-    WriteBinaryPOD(output, cur_element_count_);
-    WriteBinaryPOD(output, size_fat_node_level0_);
-    WriteBinaryPOD(output, global_enterpoint_node_);
-    WriteBinaryPOD(output, global_max_level_);
-    WriteBinaryPOD(output, mult_);
-    WriteBinaryPOD(output, data_offset_);
-    WriteBinaryPOD(output, label_offset_);
-    WriteBinaryPOD(output, payload_offset_);
-    // WriteBinaryPOD(output, size_node_);
-
-    //*slot_enterpoint_nodes_, *slot_maxlevels_, *data_level0_memory_,
-    //**link_lists_
-
-    output.write(data_level0_memory_,
-                 cur_element_count_ * size_fat_node_level0_);
-
-    for (size_t i = 0; i < cur_element_count_; i++)
+    if (repair_batch_size == 0)
+      throw std::runtime_error("The repair batch size must be positive");
+    for (size_t begin = 0; begin < cur_element_count_;
+         begin += repair_batch_size)
     {
-      unsigned int linkListSize =
-          element_levels_[i] > 0 ? size_node_ * element_levels_[i] : 0;
-      WriteBinaryPOD(output, linkListSize);
-      if (linkListSize) output.write(link_lists_[i], linkListSize);
+      RepairDeletedLinks(begin, std::min<size_t>(begin + repair_batch_size,
+                                                 cur_element_count_));
     }
-    output.write(reinterpret_cast<char *>(slot_enterpoint_nodes_),
-                 sizeof(tableint) * num_segments_);
-    output.write(reinterpret_cast<char *>(slot_maxlevels_),
-                 sizeof(tableint) * num_segments_);
+    CompactDeletedElements();
+  }
 
-    WriteBinaryPOD(output, (unsigned)skiplist_heads_.size());
-    for (tableint id : skiplist_heads_)
+  // Runs the first phase of the consolidation on the elements with internal
+  // ids in [begin, end).
+  void RepairDeletedLinks(tableint begin, tableint end)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    end = std::min<tableint>(end, cur_element_count_);
+    for (tableint id = begin; id < end; id++)
     {
-      WriteBinaryPOD(output, id);
+      if (IsMarkedDeleted(id)) continue;
+
+      for (int level = 0; level <= element_levels_[id]; level++)
+      {
+        bool is_changed = false;
+        for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+        {
+          is_changed |= RepairSlotLinks(id, level, slot_i);
+        }
+        if (is_changed)
+        {
+          std::unique_lock<std::mutex> lock(link_list_locks_[id]);
+          RefreshGlobalLinks(id, level);
+        }
+      }
     }
+  }
 
-    size_t bitmap_serial_bytes = 0;
+  // Whether `CompactDeletedElements` has nothing to do.
+  bool IsCompacted() const
+  {
+    return num_deleted_ == 0 && free_ids_.empty() &&
+           linked_retired_ids_.empty() &&
+           std::all_of(slot_generations_.begin(), slot_generations_.end(),
+                       [](tableint generation) { return generation == 0; }) &&
+           std::none_of(
+               updated_flags_.begin(),
+               updated_flags_.begin() + cur_element_count_,
+               [](const std::atomic<bool> &flag) { return flag.load(); });
+  }
+
+  // Runs the second phase of the consolidation. Links to deleted elements left
+  // by a partial repair are dropped. The ids of retired elements are compacted
+  // as well, and the generations of the slots are reset.
+  void CompactDeletedElements()
+  {
+    std::unique_lock<std::shared_mutex> lock_index(index_guard_);
+    if (IsCompacted()) return;
+
+    std::vector<tableint> new_ids(cur_element_count_, -1);
+    tableint num_live = 0;
     for (tableint id = 0; id < cur_element_count_; id++)
     {
-      for (int level = 0; level <= element_levels_[id]; level++)
+      if (IsMarkedDeleted(id))
       {
-        bitmap_serial_bytes +=
-            sizeof(unsigned) +
-            (global_link_bitmaps_[id][level]->size() + 7) / 8;  // 向上取整
+        FreeElement(id);
+      }
+      else
+      {
+        new_ids[id] = num_live++;
       }
     }
-    WriteBinaryPOD(output, bitmap_serial_bytes);
 
+    // Move the live elements to their new ids. The new id is never larger
+    // than the old one, so the elements are moved in ascending order.
+    for (tableint id = 0; id < cur_element_count_; id++)
+    {
+      tableint new_id = new_ids[id];
+      if ((signed)new_id == -1 || new_id == id) continue;
+
+      memcpy(data_level0_memory_ + size_fat_node_level0_ * new_id,
+             data_level0_memory_ + size_fat_node_level0_ * id,
+             size_fat_node_level0_);
+      link_lists_[new_id]          = link_lists_[id];
+      global_link_bitmaps_[new_id] = global_link_bitmaps_[id];
+      element_levels_[new_id]      = element_levels_[id];
+      moved_flags_[new_id]         = moved_flags_[id].load();
+      if (link_dists_ != nullptr)
+      {
+        memcpy(GetMutableLinkDists(new_id, 0, 0), GetLinkDists(id, 0, 0),
+               num_segments_ * (1 + max_links_per_slot_level0_) *
+                   sizeof(dist_t));
+        link_dists_[new_id] = link_dists_[id];
+      }
+    }
     for (tableint id = 0; id < cur_element_count_; id++)
+    {
+      deleted_flags_[id] = false;
+      if (id < num_live) continue;
+      moved_flags_[id]         = false;
+      link_lists_[id]          = nullptr;
+      global_link_bitmaps_[id] = nullptr;
+      element_levels_[id]      = 0;
+      if (link_dists_ != nullptr) link_dists_[id] = nullptr;
+    }
+
+    // Rewrite the links and the skiplist with the new ids, stamping the lists
+    // with the generation 0
+    std::vector<std::pair<tableint, int>> to_refresh;
+    for (tableint id = 0; id < num_live; id++)
     {
       for (int level = 0; level <= element_levels_[id]; level++)
       {
-        SerializeBitmap(output, *global_link_bitmaps_[id][level]);
+        bool is_dropped = HasStaleGlobalLinks(id, level);
+        for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+        {
+          tableint *links = GetMutableLinks(id, level, slot_i);
+          tableint *data  = links + 1;
+          dist_t *dists   = GetMutableLinkDists(id, level, slot_i);
+          size_t count    = GetLinkCount(links);
+          size_t kept     = 0;
+          for (size_t j = 0; j < count; j++)
+          {
+            tableint new_id = new_ids[data[j]];
+            if ((signed)new_id == -1)
+            {
+              is_dropped = true;
+              continue;
+            }
+            if (dists)
+            {
+              dists[1 + kept] =
+                  updated_flags_[data[j]]
+                      ? fstdistfunc_(GetDataByInternalId(id),
+                                     GetDataByInternalId(new_id),
+                                     dist_func_param_)
+                      : dists[1 + j];
+            }
+            data[kept++] = new_id;
+          }
+          *links = kept;
+        }
+        if (is_dropped) to_refresh.emplace_back(id, level);
+
+        tableint next = GetSkipListNext(id, level);
+        if ((signed)next != -1) SetSkipListNext(id, level, new_ids[next]);
       }
     }
+    for (auto &head : skiplist_heads_)
+    {
+      if ((signed)head != -1) head = new_ids[head];
+    }
+    slot_generations_.assign(num_segments_, 0);
+    for (tableint id = 0; id < cur_element_count_; id++)
+    {
+      updated_flags_[id] = false;
+    }
 
-    output.close();
+    // The bitmaps are positional, so they are recomputed for shrunk lists
+    for (auto &[id, level] : to_refresh)
+    {
+      RefreshGlobalLinks(id, level);
+    }
+
+    label_lookup_.clear();
+    for (tableint id = 0; id < num_live; id++)
+    {
+      label_lookup_[GetLabelByInternalId(id)] = id;
+    }
+    cur_element_count_ = num_live;
+    num_deleted_       = 0;
+    free_ids_.clear();
+    linked_retired_ids_.clear();
+
+    // Fix the entry points
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      tableint ep = GetSlotEntrypoint(slot_i).id;
+      if ((signed)ep == -1) continue;
+
+      ep = (signed)new_ids[ep] != -1 ? new_ids[ep] : FindSlotEnterpoint(slot_i);
+      SetSlotEntrypoint(slot_i, ep,
+                        (signed)ep == -1 ? -1 : element_levels_[ep]);
+    }
+    if ((signed)GetGlobalEntrypoint().id != -1)
+    {
+      tableint ep = new_ids[GetGlobalEntrypoint().id];
+      if ((signed)ep == -1) ep = FindGlobalEnterpoint();
+      SetGlobalEntrypoint(ep, (signed)ep == -1 ? -1 : element_levels_[ep]);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  /// Methods for sliding window
+  ///////////////////////////////////////////////////////////////////////////////
+
+  /*
+   * Treats the slots as a ring over the payload axis, for payloads growing
+   * over time such as ingestion timestamps: the oldest slot (the lowest
+   * range) is retired and reopened as the newest one, covering
+   * [end of the newest slot, new_upper_bound).
+   *
+   * Nothing is rebuilt, and no link list is rewritten, so the retirement only
+   * walks the retired elements:
+   *   - they form a prefix of the skiplist, which is cut;
+   *   - their ids are put into a free list reused by the next insertions;
+   *   - the links of every element into the slot are invalidated at once by
+   *     bumping the generation of the slot, which is stamped into the link
+   *     count word of every slot list.
+   * The global links pruned by links of the slot are recomputed lazily, when
+   * the links of their element are written again (see `AddGlobalLink`), and
+   * the searches skip the bits of the stale lists meanwhile.
+   *
+   * An element moved into the slot by `UpdatePayload` may still be linked from
+   * the lists of its former slot, so its id is not reused before the next
+   * `CompactDeletedElements`. Elements of the slot already marked deleted are
+   * not in the skiplist and are left to the consolidation as well.
+   *
+   * The generation has kLinkCountBits bits. The consolidation resets them, and
+   * when one would wrap around, the lists of the slot stamped long ago would
+   * read as current again: the retirement throws, asking to consolidate.
+   * Returns the number of retired elements.
+   */
+  size_t RetireOldestSlot(Scalar new_upper_bound)
+  {
+    std::unique_lock<std::shared_mutex> lock_index(index_guard_);
+    if (num_segments_ < 2)
+      throw std::runtime_error("A sliding window needs at least two slots");
+
+    unsigned oldest = 0, newest = 0;
+    for (unsigned slot_i = 1; slot_i < num_segments_; slot_i++)
+    {
+      if (slot_ranges_[slot_i].first < slot_ranges_[oldest].first)
+        oldest = slot_i;
+      if (slot_ranges_[slot_i].second > slot_ranges_[newest].second)
+        newest = slot_i;
+    }
+    if (slot_generations_[oldest] == kLinkCountMask)
+      throw std::runtime_error(
+          "The generations of the slot are exhausted: consolidate the index");
+
+    // Elements beyond the newest range belong to the newest slot, so the new
+    // range starts after them. The last element is found from the top of the
+    // skiplist.
+    Scalar start  = slot_ranges_[newest].second;
+    tableint tail = -1;
+    for (int level = skiplist_heads_.size() - 1; level >= 0; level--)
+    {
+      for (tableint next = GetSkipListSuccessor(tail, level); (signed)next != -1;
+           next = GetSkipListNext(next, level))
+      {
+        tail = next;
+      }
+    }
+    if ((signed)tail != -1 &&
+        QueryExtension::ComputeSlotIdx(GetPayloadByInternalId(tail),
+                                       slot_ranges_) != oldest &&
+        !(QueryExtension::Payload2Scalar(GetPayloadByInternalId(tail)) < start))
+    {
+      start = QueryExtension::Payload2Scalar(GetPayloadByInternalId(tail)) + 1;
+    }
+    if (!(start < new_upper_bound))
+      throw std::runtime_error("The new slot range is empty");
+
+    // Cut the skiplist prefix of the oldest slot
+    std::vector<tableint> retired;
+    for (tableint cur = GetSkipListSuccessor(-1, 0);
+         (signed)cur != -1 && QueryExtension::ComputeSlotIdx(
+                                  GetPayloadByInternalId(cur), slot_ranges_) ==
+                                  oldest;
+         cur = GetSkipListNext(cur, 0))
+    {
+      retired.push_back(cur);
+    }
+    for (int level = 0; level < (int)skiplist_heads_.size(); level++)
+    {
+      tableint head = skiplist_heads_[level];
+      while ((signed)head != -1 &&
+             QueryExtension::ComputeSlotIdx(GetPayloadByInternalId(head),
+                                            slot_ranges_) == oldest)
+      {
+        head = GetSkipListNext(head, level);
+      }
+      skiplist_heads_[level] = head;
+    }
+
+    for (tableint id : retired)
+    {
+      label_lookup_.erase(GetLabelByInternalId(id));
+      deleted_flags_[id] = true;
+      if (moved_flags_[id])
+        linked_retired_ids_.push_back(id);
+      else
+        free_ids_.push_back(id);
+    }
+    slot_generations_[oldest] += 1;
+    slot_ranges_[newest].second = start;
+    slot_ranges_[oldest]        = std::make_pair(start, new_upper_bound);
+
+    SetSlotEntrypoint(oldest, -1, -1);
+    tableint global_ep = GetGlobalEntrypoint().id;
+    if ((signed)global_ep != -1 && IsMarkedDeleted(global_ep))
+    {
+      global_ep = FindGlobalEnterpoint();
+      SetGlobalEntrypoint(global_ep, (signed)global_ep == -1
+                                         ? -1
+                                         : element_levels_[global_ep]);
+    }
+
+    return retired.size();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  /// Methods for save/load index
+  ///////////////////////////////////////////////////////////////////////////////
+
+  void SaveIndex(const std::string &location)
+  {
+    std::shared_lock<std::shared_mutex> lock_index(index_guard_);
+    WriteIndex(location, num_unlinked_ > 0);
   }
 
   void LoadIndex(const std::string &location, SpaceInterface<dist_t> *s,
@@ -1146,14 +1505,19 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     ReadBinaryPOD(input, num_segments_);
     ReadBinaryVector(input, slot_ranges_);
     ReadBinaryPOD(input, max_elements_);
-    ReadBinaryPOD(input, cur_element_count_);
+    size_t cur_element_count;
+    ReadBinaryPOD(input, cur_element_count);
+    cur_element_count_ = cur_element_count;
 
     size_t max_elements = max_elements_i;
     if (max_elements < cur_element_count_) max_elements = max_elements_;  //?
     max_elements_ = max_elements;
     ReadBinaryPOD(input, size_fat_node_level0_);
-    ReadBinaryPOD(input, global_enterpoint_node_);
-    ReadBinaryPOD(input, global_max_level_);
+    tableint global_ep;
+    int global_max_level;
+    ReadBinaryPOD(input, global_ep);
+    ReadBinaryPOD(input, global_max_level);
+    SetGlobalEntrypoint(global_ep, global_max_level);
     ReadBinaryPOD(input, mult_);
     ReadBinaryPOD(input, data_offset_);
     ReadBinaryPOD(input, label_offset_);
@@ -1194,6 +1558,15 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     ReadBinaryPOD(input, bitmap_serial_bytes);
     input.seekg(bitmap_serial_bytes, input.cur);
 
+    while (input.tellg() >= 0 && input.tellg() < total_filesize)
+    {
+      unsigned section_tag;
+      size_t section_size;
+      ReadBinaryPOD(input, section_tag);
+      ReadBinaryPOD(input, section_size);
+      input.seekg(section_size, input.cur);
+    }
+
     if (input.tellg() != total_filesize)
     {
       throw std::runtime_error("Index seems to be corrupted or unsupported");
@@ -1203,8 +1576,8 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     /// Optional check end
 
     input.seekg(pos, input.beg);
-    data_level0_memory_ =
-        (char *)malloc(cur_element_count_ * size_fat_node_level0_);
+    // Room for `max_elements`, so that the loaded index can grow
+    data_level0_memory_ = (char *)malloc(max_elements * size_fat_node_level0_);
     if (data_level0_memory_ == nullptr)
       throw std::runtime_error(
           "Not enough memory: LoadIndex failed to allocate level0");
@@ -1216,6 +1589,7 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
             sizeof(tableint);  // fix: max_links_per_slot -> max_links_per_slot_
     size_node_ = sizeof(tableint) + num_segments_ * size_per_slot_;
     std::vector<std::mutex>(max_elements).swap(link_list_locks_);
+    std::vector<std::atomic<unsigned>>(max_elements).swap(link_list_versions_);
     std::vector<std::mutex>(max_update_element_locks)
         .swap(link_list_update_locks_);
     std::vector<std::mutex>(num_segments_).swap(global_slot_locks_);
@@ -1250,14 +1624,17 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
         input.read(link_lists_[i], linkListSize);
       }
     }
-    slot_enterpoint_nodes_ =
-        (tableint *)malloc(sizeof(tableint) * num_segments_);
-    input.read(reinterpret_cast<char *>(slot_enterpoint_nodes_),
-               sizeof(tableint) * num_segments_);
-
-    slot_maxlevels_ = (int *)malloc(sizeof(int) * num_segments_);
-    input.read(reinterpret_cast<char *>(slot_maxlevels_),
+    std::vector<tableint> slot_eps(num_segments_);
+    std::vector<int> slot_max_levels(num_segments_);
+    input.read(reinterpret_cast<char *>(slot_eps.data()),
                sizeof(tableint) * num_segments_);
+    input.read(reinterpret_cast<char *>(slot_max_levels.data()),
+               sizeof(int) * num_segments_);
+    slot_entrypoints_.reset(new std::atomic<uint64_t>[num_segments_]);
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      SetSlotEntrypoint(slot_i, slot_eps[slot_i], slot_max_levels[slot_i]);
+    }
 
     int size;
     ReadBinaryPOD(input, size);
@@ -1284,6 +1661,106 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       }
     }
 
+    std::vector<std::atomic<bool>>(max_elements).swap(deleted_flags_);
+    num_deleted_ = 0;
+    slot_generations_.assign(num_segments_, 0);
+    free_ids_.clear();
+    linked_retired_ids_.clear();
+    std::vector<std::atomic<bool>>(max_elements).swap(moved_flags_);
+    std::vector<std::atomic<bool>>(max_elements).swap(updated_flags_);
+    prune_alpha_        = 1.0f;
+    global_prune_alpha_ = 1.0f;
+    num_unlinked_       = 0;
+    while (input.tellg() < total_filesize)
+    {
+      unsigned section_tag;
+      size_t section_size;
+      ReadBinaryPOD(input, section_tag);
+      ReadBinaryPOD(input, section_size);
+      switch (section_tag)
+      {
+        case kSectionTombstones:
+          for (size_t i = 0; i < section_size / sizeof(tableint); i++)
+          {
+            tableint id;
+            ReadBinaryPOD(input, id);
+            if (!input || id >= cur_element_count_)
+              throw std::runtime_error(
+                  "Index seems to be corrupted or unsupported");
+            deleted_flags_[id] = true;
+            num_deleted_ += 1;
+          }
+          break;
+        case kSectionSlotRing:
+        {
+          input.read(reinterpret_cast<char *>(slot_generations_.data()),
+                     num_segments_ * sizeof(tableint));
+          std::vector<tableint> moved_ids;
+          for (std::vector<tableint> *ids :
+               {&free_ids_, &linked_retired_ids_, &moved_ids})
+          {
+            size_t num_ids = 0;
+            ReadBinaryPOD(input, num_ids);
+            if (!input || num_ids > cur_element_count_)
+              throw std::runtime_error(
+                  "Index seems to be corrupted or unsupported");
+            ids->resize(num_ids);
+            input.read(reinterpret_cast<char *>(ids->data()),
+                       num_ids * sizeof(tableint));
+            if (!input ||
+                std::any_of(ids->begin(), ids->end(), [&](tableint id) {
+                  return id >= cur_element_count_;
+                }))
+              throw std::runtime_error(
+                  "Index seems to be corrupted or unsupported");
+          }
+          for (tableint id : free_ids_) deleted_flags_[id] = true;
+          for (tableint id : linked_retired_ids_) deleted_flags_[id] = true;
+          for (tableint id : moved_ids) moved_flags_[id] = true;
+
+          // The labels of the retired elements may have been inserted again
+          label_lookup_.clear();
+          std::unordered_set<tableint> retired_ids(free_ids_.begin(),
+                                                   free_ids_.end());
+          retired_ids.insert(linked_retired_ids_.begin(),
+                             linked_retired_ids_.end());
+          for (tableint id = 0; id < cur_element_count_; id++)
+          {
+            if (!retired_ids.count(id))
+              label_lookup_[GetLabelByInternalId(id)] = id;
+          }
+          break;
+        }
+        case kSectionPruning:
+          ReadBinaryPOD(input, prune_alpha_);
+          ReadBinaryPOD(input, global_prune_alpha_);
+          break;
+        case kSectionBuildState:
+        {
+          if (section_size < 4 * sizeof(size_t) + sizeof(bool))
+            throw std::runtime_error(
+                "Index seems to be corrupted or unsupported");
+          ReadBinaryPOD(input, num_unlinked_);
+          ReadBinaryPOD(input, random_seed_);
+          ReadBinaryPOD(input, deterministic_build_);
+          ReadBinaryPOD(input, build_threads_);
+          ReadBinaryPOD(input, build_batch_size_);
+          std::string state(
+              section_size - 4 * sizeof(size_t) - sizeof(bool), '\0');
+          input.read(&state[0], state.size());
+          std::istringstream generators(state);
+          generators >> level_generator_ >> update_probability_generator_;
+          if (!input || num_unlinked_ > cur_element_count_)
+            throw std::runtime_error(
+                "Index seems to be corrupted or unsupported");
+          break;
+        }
+        default:
+          input.seekg(section_size, input.cur);
+          break;
+      }
+    }
+
     input.close();
 
     size_per_slot_level0_ = (max_links_per_slot_level0_ + 1) * sizeof(tableint);
@@ -1393,14 +1870,179 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   ///////////////////////////////////////////////////////////////////////////////
   size_t get_max_elements() const { return max_elements_; }
   size_t get_current_count() const { return cur_element_count_; }
+  size_t get_deleted_count() const { return num_deleted_; }
+  size_t get_free_count() const { return free_ids_.size(); }
   size_t get_ef() const { return ef_; }
   size_t get_al() const { return al_; }
   size_t get_m() const { return max_links_per_slot_; }
   size_t get_s() const { return num_segments_; }
   size_t get_ef_construction() const { return ef_construction_; }
+  size_t get_random_seed() const { return random_seed_; }
+  const SlotRanges &get_slot_ranges() const { return slot_ranges_; }
+  float get_prune_alpha() const { return prune_alpha_; }
+  float get_global_prune_alpha() const { return global_prune_alpha_; }
 
   void set_ef(size_t ef) { ef_ = ef; }
 
+  // While deferred, the insertions do not maintain the global link bitmaps,
+  // which `KnnSearch` and `PostFiltering` rely on, until `ComputeGlobalLinks`.
+  void set_defer_global_links(bool defer) { defer_global_links_ = defer; }
+
+  // In a deterministic build, the level of an element derives from the seed
+  // and its label, and `InsertBatch` takes its batch-synchronous path even
+  // with one thread, so that the same inputs give the same index whatever
+  // the number of threads.
+  void set_deterministic_build(bool deterministic)
+  {
+    deterministic_build_ = deterministic;
+  }
+
+  // With several threads, `Insert` links a new element into the graphs of the
+  // slots in parallel, on a pool of `num_threads - 1` workers and the calling
+  // thread, which cuts the latency of a single insertion by up to the number
+  // of slots. 0 means the number of cores, and 1 links the slots in turn.
+  // Must not be called concurrently with insertions.
+  void set_insert_threads(size_t num_threads)
+  {
+    if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+    num_threads = std::min(num_threads, num_segments_);
+    if (num_threads <= 1)
+      insert_pool_.reset();
+    else
+      insert_pool_ = std::make_unique<WorkerPool>(num_threads - 1);
+  }
+
+  // Searches the graphs of all the slots together when linking a new element,
+  // see `SearchLayerJointForInsertion`. Applies to the insertions that link
+  // the slots in turn, i.e. not with `set_insert_threads` or in parallel
+  // `InsertBatch`.
+  void set_joint_insertion_search(bool joint)
+  {
+    joint_insertion_search_ = joint;
+  }
+
+  // Makes `InsertBatch` write a checkpoint of the index to `location` every
+  // `interval` linked elements (0 disables it). The checkpoint is an index
+  // file that also keeps the elements still to link and the random state;
+  // once loaded, `ResumeInsertBatch` finishes the build. It must be resumed
+  // before any other update.
+  void set_checkpoint(const std::string &location, size_t interval)
+  {
+    checkpoint_location_ = location;
+    checkpoint_interval_ = location.empty() ? 0 : interval;
+  }
+
+  // Relaxes the heuristic that selects the links of every slot as in Vamana:
+  // a candidate is only pruned by a selected neighbor `alpha` times closer to
+  // it than the element (1 is the strict heuristic of HNSW). Larger values
+  // give denser graphs, with fewer hops in thinly connected filtered
+  // searches. Applies to the links selected afterwards, and is saved with
+  // the index.
+  void set_prune_alpha(float alpha)
+  {
+    if (!(alpha >= 1)) throw std::runtime_error("The alpha must be >= 1");
+    prune_alpha_ = alpha;
+  }
+
+  // Same for the global links; `ComputeGlobalLinks` applies it to the
+  // existing elements.
+  void set_global_prune_alpha(float alpha)
+  {
+    if (!(alpha >= 1)) throw std::runtime_error("The alpha must be >= 1");
+    global_prune_alpha_ = alpha;
+  }
+
+  // Schedules the search effort of the insertions by slot distance: a new
+  // element searches the graph of a slot at distance d from its own slot with
+  // `efs[d]`, or the last value beyond. The links to far slots only serve the
+  // queries over wide ranges, so they may be built with less effort. An empty
+  // schedule gives `ef_construction` to all the slots. Must not be called
+  // concurrently with insertions.
+  void set_ef_construction_schedule(const std::vector<size_t> &efs)
+  {
+    std::vector<size_t> efs_by_slots;
+    if (!efs.empty())
+    {
+      efs_by_slots.resize(num_segments_ * num_segments_);
+      for (unsigned elem_slot = 0; elem_slot < num_segments_; elem_slot++)
+      {
+        for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+        {
+          size_t distance = elem_slot > slot_i ? elem_slot - slot_i
+                                               : slot_i - elem_slot;
+          efs_by_slots[elem_slot * num_segments_ + slot_i] =
+              efs[std::min(distance, efs.size() - 1)];
+        }
+      }
+    }
+    set_ef_construction_by_slots(efs_by_slots);
+  }
+
+  // Same with one value per pair of slots, indexed by the slot of the new
+  // element times S plus the searched slot, e.g. from how often the queries
+  // span both slots.
+  void set_ef_construction_by_slots(const std::vector<size_t> &efs)
+  {
+    if (!efs.empty() && efs.size() != num_segments_ * num_segments_)
+      throw std::runtime_error(
+          "The ef schedule needs one value per pair of slots");
+    if (std::find(efs.begin(), efs.end(), 0) != efs.end())
+      throw std::runtime_error("The ef of the insertions must be positive");
+    ef_construction_by_slots_ = efs;
+  }
+
+  // Stores the distances of the links next to them, so that the heuristics
+  // reuse them instead of recomputing the edge lengths. With `prune_search`,
+  // the searches also skip the neighbors that the triangle inequality proves
+  // farther than the current results, which only holds for the squared L2
+  // distances of `L2Space`. The distances of the existing links are computed
+  // here; they are not saved with the index, so this is called again after
+  // loading it. The distances kept to an element whose vector is replaced
+  // by `Insert` are only refreshed for its repaired neighbors: the searches
+  // do not skip it by the others until the next consolidation, which
+  // recomputes them. Must not run concurrently with other operations.
+  void EnableLinkDistances(bool prune_search = false)
+  {
+    prune_by_link_dists_ = prune_search;
+    if (link_dists_level0_ != nullptr) return;
+
+    link_dists_level0_ = (dist_t *)malloc(sizeof(dist_t) * max_elements_ *
+                                          num_segments_ *
+                                          (1 + max_links_per_slot_level0_));
+    link_dists_ = (dist_t **)calloc(max_elements_, sizeof(dist_t *));
+    if (link_dists_level0_ == nullptr || link_dists_ == nullptr)
+      throw std::runtime_error(
+          "Not enough memory: failed to allocate link distances");
+
+    for (tableint id = 0; id < cur_element_count_; id++)
+    {
+      // Skip the retired ids
+      if (global_link_bitmaps_[id] == nullptr) continue;
+      AllocLinkDists(id, element_levels_[id]);
+      ComputeLinkDists(id);
+    }
+  }
+
+  // Recomputes the distances of the links of an element. The caller must hold
+  // the lock of the element.
+  void ComputeLinkDists(tableint id)
+  {
+    for (int level = 0; level <= element_levels_[id]; level++)
+    {
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        const tableint *links = GetLinks(id, level, slot_i);
+        dist_t *dists         = GetMutableLinkDists(id, level, slot_i);
+        for (size_t j = 1; j <= GetLinkCount(links); j++)
+        {
+          dists[j] = fstdistfunc_(GetDataByInternalId(id),
+                                  GetDataByInternalId(links[j]),
+                                  dist_func_param_);
+        }
+      }
+    }
+  }
+
   void set_al(size_t al)
   {
     al_        = al;
@@ -1438,121 +2080,1480 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   }
 
  private:
-  void PruneGlobalLinks(tableint obj, int obj_level)
+  // A reverse link from `id` into the `slot_i` list of `target` at `level`,
+  // deferred by `InsertBatch` to be applied with the others of the batch.
+  struct ReverseLink
   {
-    {
-      // The lock for the new inserted object has already been hold in `Insert`
-      // std::unique_lock<std::mutex> el_lock(link_list_locks_[obj]);
-      global_link_bitmaps_[obj] =
-          (Bitmap **)malloc(sizeof(Bitmap *) * (obj_level + 1));
-      for (int level = 0; level <= obj_level; level++)
-      {
-        global_link_bitmaps_[obj][level] = new Bitmap();
-      }
-    }
+    tableint target;
+    int level;
+    unsigned slot_i;
+    dist_t dist;
+    tableint id;
 
-    for (int level = 0; level <= obj_level; level++)
+    bool operator<(const ReverseLink &other) const
     {
-      std::unordered_map<tableint, unsigned> bitmap_pos_map;
-      {
-        // std::unique_lock<std::mutex> el_lock(link_list_locks_[obj]);
-        Bitmap prune_mask = PruneGlobalLinksDetail(obj, level, bitmap_pos_map);
-        (*global_link_bitmaps_[obj][level]).swap(prune_mask);
-      }
-
-      for (auto [id, _] : bitmap_pos_map)
-      {
-        std::unique_lock<std::mutex> el_lock(link_list_locks_[id]);
-        std::unordered_map<tableint, unsigned> tmp_map;
-        Bitmap prune_mask = PruneGlobalLinksDetail(id, level, tmp_map);
-        (*global_link_bitmaps_[id][level]).swap(prune_mask);
-      }
+      return std::tie(target, level, slot_i, dist, id) <
+             std::tie(other.target, other.level, other.slot_i, other.dist,
+                      other.id);
     }
-  }
+  };
 
-  Bitmap PruneGlobalLinksDetail(
-      tableint obj, int level,
-      std::unordered_map<tableint, unsigned> &bitmap_pos_map)
+  // A candidate neighbor of `BuildByNNDescent`, new until it was joined
+  struct NNDescentCandidate
   {
-    const void *query = GetDataByInternalId(obj);
-    unsigned num_elem_per_slot =
-        level == 0 ? (1 + max_links_per_slot_ * 2) : (1 + max_links_per_slot_);
-    const size_t n_preserve =
-        level == 0 ? (max_links_per_slot_ * 2) : (max_links_per_slot_);
-    unsigned bitmap_size = num_segments_ * num_elem_per_slot;
-    Bitmap result(bitmap_size);
+    dist_t dist;
+    tableint id;
+    bool is_new;
+  };
 
-    std::vector<std::pair<dist_t, tableint>> preserve_list;
-    std::priority_queue<std::pair<dist_t, tableint>> queue_closest;
+  // Writes the index, with the state of the bulk load in progress if
+  // `with_build_state`.
+  void WriteIndex(const std::string &location, bool with_build_state)
+  {
+    std::ofstream output(location, std::ios::binary);
+    std::streampos position;
+    WriteBinaryPOD(output, ef_construction_);
+    WriteBinaryPOD(output, max_links_per_slot_);
+    WriteBinaryPOD(output, max_links_per_slot_level0_);
+    WriteBinaryPOD(output, size_per_slot_level0_);
+    WriteBinaryPOD(output, num_segments_);
+    WriteBinaryVector(output, slot_ranges_);
+    WriteBinaryPOD(output, max_elements_);
+    WriteBinaryPOD(output, cur_element_count_.load());
+    WriteBinaryPOD(output, size_fat_node_level0_);
+    Entrypoint global_entrypoint = GetGlobalEntrypoint();
+    WriteBinaryPOD(output, global_entrypoint.id);
+    WriteBinaryPOD(output, global_entrypoint.level);
+    WriteBinaryPOD(output, mult_);
+    WriteBinaryPOD(output, data_offset_);
+    WriteBinaryPOD(output, label_offset_);
+    WriteBinaryPOD(output, payload_offset_);
+    // WriteBinaryPOD(output, size_node_);
 
-    size_t num_total_neighbors = 0;
-    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
-    {
-      auto *linklist = GetLinks(obj, level, slot_i);
-      auto count     = GetLinkCount(linklist);
-      for (unsigned j = 0; j < count; j++)
-      {
-        num_total_neighbors += 1;
-        result[slot_i * num_elem_per_slot + 1 + j] = 1;
-      }
-    }
+    //*slot_entrypoints_, *data_level0_memory_,
+    //**link_lists_
 
-    if (num_total_neighbors <= n_preserve)
+    output.write(data_level0_memory_,
+                 cur_element_count_ * size_fat_node_level0_);
+
+    for (size_t i = 0; i < cur_element_count_; i++)
     {
-      return result;
+      unsigned int linkListSize =
+          element_levels_[i] > 0 ? size_node_ * element_levels_[i] : 0;
+      WriteBinaryPOD(output, linkListSize);
+      if (linkListSize) output.write(link_lists_[i], linkListSize);
     }
-
+    std::vector<tableint> slot_eps(num_segments_);
+    std::vector<int> slot_max_levels(num_segments_);
     for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
     {
-      auto *linklist       = GetLinks(obj, level, slot_i);
-      const tableint *data = linklist + 1;
-      auto count           = GetLinkCount(linklist);
-      for (unsigned i = 0; i < count; i++)
-      {
-        tableint neighbor_id = data[i];
-        queue_closest.emplace(
-            -fstdistfunc_(query, GetDataByInternalId(neighbor_id),
-                          dist_func_param_),
-            neighbor_id);
-        bitmap_pos_map[neighbor_id] = slot_i * num_elem_per_slot + 1 + i;
-      }
+      Entrypoint entrypoint   = GetSlotEntrypoint(slot_i);
+      slot_eps[slot_i]        = entrypoint.id;
+      slot_max_levels[slot_i] = entrypoint.level;
     }
+    output.write(reinterpret_cast<char *>(slot_eps.data()),
+                 sizeof(tableint) * num_segments_);
+    output.write(reinterpret_cast<char *>(slot_max_levels.data()),
+                 sizeof(int) * num_segments_);
 
-    while (queue_closest.size())
+    WriteBinaryPOD(output, (unsigned)skiplist_heads_.size());
+    for (tableint id : skiplist_heads_)
     {
-      if (preserve_list.size() >= n_preserve) break;
-      std::pair<dist_t, tableint> curent_pair =
-          queue_closest.top();  // dist最小的
-      dist_t dist_to_query = -curent_pair.first;
-      queue_closest.pop();
-      bool good = true;
+      WriteBinaryPOD(output, id);
+    }
 
-      for (std::pair<dist_t, tableint> second_pair : preserve_list)
+    size_t bitmap_serial_bytes = 0;
+    for (tableint id = 0; id < cur_element_count_; id++)
+    {
+      for (int level = 0; level <= element_levels_[id]; level++)
+      {
+        bitmap_serial_bytes +=
+            sizeof(unsigned) +
+            (global_link_bitmaps_[id][level]->size() + 7) / 8;  // 向上取整
+      }
+    }
+    WriteBinaryPOD(output, bitmap_serial_bytes);
+
+    for (tableint id = 0; id < cur_element_count_; id++)
+    {
+      for (int level = 0; level <= element_levels_[id]; level++)
+      {
+        SerializeBitmap(output, *global_link_bitmaps_[id][level]);
+      }
+    }
+
+    // Optional sections are only written when not empty, so that indexes
+    // without them keep the plain format.
+    if (num_deleted_ > 0)
+    {
+      // The retired elements are flagged as well, but saved with the ring
+      std::unordered_set<tableint> retired_ids(free_ids_.begin(),
+                                               free_ids_.end());
+      retired_ids.insert(linked_retired_ids_.begin(),
+                         linked_retired_ids_.end());
+      std::vector<tableint> deleted_ids;
+      deleted_ids.reserve(num_deleted_);
+      for (tableint id = 0; id < cur_element_count_; id++)
+      {
+        if (IsMarkedDeleted(id) && !retired_ids.count(id))
+          deleted_ids.push_back(id);
+      }
+      WriteBinaryPOD(output, (unsigned)kSectionTombstones);
+      WriteBinaryPOD(output, deleted_ids.size() * sizeof(tableint));
+      output.write(reinterpret_cast<char *>(deleted_ids.data()),
+                   deleted_ids.size() * sizeof(tableint));
+    }
+
+    // Section: slot generations | free ids | retired ids kept out of reuse |
+    // ids moved between slots, each list preceded by its size
+    std::vector<tableint> moved_ids;
+    for (tableint id = 0; id < cur_element_count_; id++)
+    {
+      if (moved_flags_[id]) moved_ids.push_back(id);
+    }
+    if (!free_ids_.empty() || !linked_retired_ids_.empty() ||
+        !moved_ids.empty() ||
+        std::any_of(slot_generations_.begin(), slot_generations_.end(),
+                    [](tableint generation) { return generation != 0; }))
+    {
+      WriteBinaryPOD(output, (unsigned)kSectionSlotRing);
+      WriteBinaryPOD(output, (num_segments_ + free_ids_.size() +
+                              linked_retired_ids_.size() + moved_ids.size()) *
+                                     sizeof(tableint) +
+                                 3 * sizeof(size_t));
+      output.write(reinterpret_cast<char *>(slot_generations_.data()),
+                   num_segments_ * sizeof(tableint));
+      for (std::vector<tableint> *ids :
+           {&free_ids_, &linked_retired_ids_, &moved_ids})
+      {
+        WriteBinaryPOD(output, ids->size());
+        output.write(reinterpret_cast<char *>(ids->data()),
+                     ids->size() * sizeof(tableint));
+      }
+    }
+
+    // Section: alpha of the slot links | alpha of the global links
+    if (prune_alpha_ != 1.0f || global_prune_alpha_ != 1.0f)
+    {
+      WriteBinaryPOD(output, (unsigned)kSectionPruning);
+      WriteBinaryPOD(output, 2 * sizeof(float));
+      WriteBinaryPOD(output, prune_alpha_);
+      WriteBinaryPOD(output, global_prune_alpha_);
+    }
+
+    // Section: unlinked elements | seed | deterministic | threads |
+    // batch size | generator states
+    if (with_build_state)
+    {
+      std::ostringstream generators;
+      generators << level_generator_ << ' ' << update_probability_generator_;
+      std::string state = generators.str();
+      WriteBinaryPOD(output, (unsigned)kSectionBuildState);
+      WriteBinaryPOD(output,
+                     4 * sizeof(size_t) + sizeof(bool) + state.size());
+      WriteBinaryPOD(output, num_unlinked_);
+      WriteBinaryPOD(output, random_seed_);
+      WriteBinaryPOD(output, deterministic_build_);
+      WriteBinaryPOD(output, build_threads_);
+      WriteBinaryPOD(output, build_batch_size_);
+      output.write(state.data(), state.size());
+    }
+
+    output.close();
+    if (!output) throw std::runtime_error("Cannot write the index");
+  }
+
+  // Writes a checkpoint through a temporary file, so that an interruption
+  // leaves the former checkpoint whole.
+  void WriteCheckpoint()
+  {
+    std::string temp_location = checkpoint_location_ + ".tmp";
+    WriteIndex(temp_location, true);
+    if (std::rename(temp_location.c_str(), checkpoint_location_.c_str()) != 0)
+      throw std::runtime_error("Cannot write the checkpoint");
+  }
+
+  // Sets up the elements of a bulk load into an empty index, with their
+  // levels and the payload skiplist, but without links. The caller must hold
+  // `index_guard_`.
+  void InitBatch(const void *data, const labeltype *labels,
+                 const Payload *payloads, size_t n)
+  {
+    {
+      std::unique_lock<std::mutex> templock_curr(cur_element_count_guard_);
+      if (cur_element_count_ != 0)
+        throw std::runtime_error("A bulk load requires an empty index");
+      if (n > max_elements_)
+        throw std::runtime_error(
+            "The number of elements exceeds the specified limit");
+      for (size_t i = 0; i < n; i++)
+      {
+        if (!label_lookup_.emplace(labels[i], i).second)
+        {
+          label_lookup_.clear();
+          throw std::runtime_error("A bulk load got a duplicated label");
+        }
+      }
+      cur_element_count_ = n;
+    }
+    if (n == 0) return;
+
+    const char *vectors = (const char *)data;
+    for (tableint id = 0; id < n; id++)
+    {
+      std::unique_lock<std::mutex> lock_el(link_list_locks_[id]);
+      InitElement(id, vectors + id * data_size_, labels[id], payloads[id],
+                  GetNewElementLevel(labels[id]));
+    }
+
+    BuildSkipList(n);
+  }
+
+  // Links the `num_unlinked_` last elements, initialized by `InitBatch`, see
+  // `InsertBatch`, serially if `build_batch_size_` is 0 and by batches
+  // otherwise. Writes a checkpoint every `checkpoint_interval_` linked
+  // elements, where the index is consistent: after an element in the serial
+  // build, and after a batch otherwise.
+  void LinkBatch(size_t num_threads)
+  {
+    const size_t n     = cur_element_count_;
+    const size_t first = n - num_unlinked_;
+    if (first == n) return;
+
+    // Called once the elements before `end` are linked
+    size_t last_checkpoint = first;
+    auto on_linked         = [&](size_t end)
+    {
+      num_unlinked_ = n - end;
+      if (checkpoint_interval_ > 0 && end < n &&
+          end - last_checkpoint >= checkpoint_interval_)
+      {
+        WriteCheckpoint();
+        last_checkpoint = end;
+      }
+    };
+
+    num_threads = std::max<size_t>(1, num_threads);
+    if (build_batch_size_ == 0)
+    {
+      for (tableint id = first; id < n; id++)
+      {
+        {
+          std::unique_lock<std::mutex> lock_el(link_list_locks_[id]);
+          LinkElement(id, GetDataByInternalId(id), element_levels_[id],
+                      QueryExtension::ComputeSlotIdx(
+                          GetPayloadByInternalId(id), slot_ranges_));
+        }
+        if (!defer_global_links_) PruneGlobalLinks(id, element_levels_[id]);
+        on_linked(id + 1);
+      }
+      return;
+    }
+
+    // Every slot is split into parts so that all the threads are busy
+    size_t parts_per_slot =
+        (num_threads + num_segments_ - 1) / num_segments_;
+    std::vector<std::vector<ReverseLink>> thread_links(num_threads);
+    std::vector<unsigned> elem_slots(n);
+    for (tableint id = 0; id < n; id++)
+    {
+      elem_slots[id] = QueryExtension::ComputeSlotIdx(
+          GetPayloadByInternalId(id), slot_ranges_);
+    }
+    // The batches resume where the linked elements end
+    std::vector<size_t> slot_sizes(num_segments_, 0);
+    for (tableint id = 0; id < first; id++) slot_sizes[elem_slots[id]]++;
+    for (size_t begin = first, end; begin < n; begin = end)
+    {
+      // A batch at most doubles every slot, so that the elements of a slot
+      // that was empty do not miss each other
+      std::vector<size_t> slot_new(num_segments_, 0);
+      for (end = begin; end < n && end - begin < build_batch_size_; end++)
+      {
+        unsigned slot_i = elem_slots[end];
+        if (slot_new[slot_i] >= std::max<size_t>(1, slot_sizes[slot_i])) break;
+        slot_new[slot_i]++;
+      }
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        slot_sizes[slot_i] += slot_new[slot_i];
+      }
+
+      size_t part_size = (end - begin + parts_per_slot - 1) / parts_per_slot;
+      ParallelFor(0, num_segments_ * parts_per_slot, num_threads,
+                  [&](size_t task, size_t thread_id)
+                  {
+                    unsigned slot_i   = task % num_segments_;
+                    size_t part_begin = begin + task / num_segments_ * part_size;
+                    size_t part_end   = std::min(end, part_begin + part_size);
+                    for (tableint id = part_begin; id < part_end; id++)
+                    {
+                      LinkElementSlot(id, GetDataByInternalId(id),
+                                      element_levels_[id], elem_slots[id],
+                                      slot_i, false, &thread_links[thread_id]);
+                    }
+                  });
+
+      // The entry points are only updated after the batch, so that the
+      // searches of the batch do not depend on the order of its elements
+      for (tableint id = begin; id < end; id++)
+      {
+        unsigned slot_i       = elem_slots[id];
+        Entrypoint entrypoint = GetSlotEntrypoint(slot_i);
+        if ((signed)entrypoint.id == -1 ||
+            element_levels_[id] > entrypoint.level)
+          SetSlotEntrypoint(slot_i, id, element_levels_[id]);
+      }
+
+      // Group the reverse links by target list
+      std::vector<ReverseLink> reverse_links;
+      for (auto &links : thread_links)
+      {
+        reverse_links.insert(reverse_links.end(), links.begin(), links.end());
+        links.clear();
+      }
+      std::sort(reverse_links.begin(), reverse_links.end());
+      std::vector<size_t> group_begins;
+      for (size_t i = 0; i < reverse_links.size(); i++)
+      {
+        if (i == 0 || reverse_links[i].target != reverse_links[i - 1].target ||
+            reverse_links[i].level != reverse_links[i - 1].level ||
+            reverse_links[i].slot_i != reverse_links[i - 1].slot_i)
+          group_begins.push_back(i);
+      }
+      group_begins.push_back(reverse_links.size());
+
+      std::vector<std::vector<std::pair<tableint, int>>> thread_changed(
+          num_threads);
+      ParallelFor(
+          0, group_begins.size() - 1, num_threads,
+          [&](size_t group, size_t thread_id)
+          {
+            const ReverseLink &first = reverse_links[group_begins[group]];
+            std::vector<std::pair<dist_t, tableint>> new_links;
+            for (size_t i = group_begins[group]; i < group_begins[group + 1];
+                 i++)
+            {
+              new_links.emplace_back(reverse_links[i].dist,
+                                     reverse_links[i].id);
+            }
+
+            std::unique_lock<std::mutex> lock(link_list_locks_[first.target]);
+            std::vector<tableint> links;
+            std::vector<dist_t> dists;
+            CopyLinks(first.target, first.level, first.slot_i, links, &dists);
+            if (SelectReverseLinks(first.target, new_links, first.level, links,
+                                   dists))
+            {
+              SetLinks(first.target, first.level, first.slot_i, links, dists);
+              thread_changed[thread_id].emplace_back(first.target,
+                                                     first.level);
+            }
+          });
+      if (defer_global_links_)
+      {
+        on_linked(end);
+        continue;
+      }
+
+      // The new elements are refreshed at all their levels
+      std::vector<std::pair<tableint, int>> changed;
+      for (auto &thread_list : thread_changed)
+      {
+        for (auto &target : thread_list)
+        {
+          if (target.first < begin || target.first >= end)
+            changed.push_back(target);
+        }
+      }
+      std::sort(changed.begin(), changed.end());
+      changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+      ParallelFor(begin, end, num_threads,
+                  [&](size_t id, size_t)
+                  { PruneGlobalLinks(id, element_levels_[id]); });
+      ParallelFor(0, changed.size(), num_threads,
+                  [&](size_t i, size_t)
+                  {
+                    std::unique_lock<std::mutex> lock(
+                        link_list_locks_[changed[i].first]);
+                    RefreshGlobalLinks(changed[i].first, changed[i].second);
+                  });
+      on_linked(end);
+    }
+  }
+
+  /*
+   * NN-Descent over `nodes`, see `BuildByNNDescent`. Returns the candidates
+   * of the node at position u for slot s from position (u * S + s) * k,
+   * sorted by distance, with the ids as positions in `nodes`. The empty
+   * entries have the maximum distance.
+   */
+  std::vector<NNDescentCandidate> NNDescentLevel(
+      const std::vector<tableint> &nodes, const std::vector<unsigned> &slots,
+      size_t k, size_t num_threads, size_t num_iterations,
+      float min_update_rate)
+  {
+    const size_t m = nodes.size();
+    const size_t S = num_segments_;
+    std::vector<NNDescentCandidate> pool(
+        m * S * k,
+        {std::numeric_limits<dist_t>::max(), (tableint)-1, false});
+    std::vector<std::mutex> locks(m);
+    // The distance of the farthest candidate of every list, to reject most
+    // of the pairs without locking
+    std::vector<std::atomic<dist_t>> bounds(m * S);
+    for (auto &bound : bounds)
+    {
+      bound.store(std::numeric_limits<dist_t>::max(),
+                  std::memory_order_relaxed);
+    }
+
+    auto distance = [&](size_t u, size_t v)
+    {
+      return fstdistfunc_(GetDataByInternalId(nodes[u]),
+                          GetDataByInternalId(nodes[v]), dist_func_param_);
+    };
+    // Adds v to the candidates of u for the slot of v, if it is closer than
+    // the farthest one
+    auto add_candidate = [&](size_t u, size_t v, dist_t dist)
+    {
+      size_t list = u * S + slots[nodes[v]];
+      if (dist >= bounds[list].load(std::memory_order_relaxed)) return false;
+      NNDescentCandidate *candidates = pool.data() + list * k;
+      std::unique_lock<std::mutex> lock(locks[u]);
+      if (dist >= candidates[k - 1].dist) return false;
+      // The distances are symmetric, so a duplicate is not farther
+      size_t pos = 0;
+      for (; candidates[pos].dist <= dist; pos++)
+      {
+        if (candidates[pos].id == v) return false;
+      }
+      std::copy_backward(candidates + pos, candidates + k - 1,
+                         candidates + k);
+      candidates[pos] = {dist, (tableint)v, true};
+      bounds[list].store(candidates[k - 1].dist, std::memory_order_relaxed);
+      return true;
+    };
+
+    // Start from random candidates, or from all the nodes of the small slots
+    std::vector<std::vector<size_t>> slot_nodes(S);
+    for (size_t u = 0; u < m; u++)
+    {
+      slot_nodes[slots[nodes[u]]].push_back(u);
+    }
+    ParallelFor(0, m, num_threads,
+                [&](size_t u, size_t)
+                {
+                  std::default_random_engine generator(random_seed_ + u);
+                  for (unsigned slot_i = 0; slot_i < S; slot_i++)
+                  {
+                    const std::vector<size_t> &members = slot_nodes[slot_i];
+                    if (members.size() <= k + 1)
+                    {
+                      for (size_t v : members)
+                      {
+                        if (v != u) add_candidate(u, v, distance(u, v));
+                      }
+                      continue;
+                    }
+                    std::uniform_int_distribution<size_t> distribution(
+                        0, members.size() - 1);
+                    for (size_t tries = 0; tries < 2 * k; tries++)
+                    {
+                      size_t v = members[distribution(generator)];
+                      if (v != u) add_candidate(u, v, distance(u, v));
+                    }
+                  }
+                });
+
+    // As in the paper, only the closest half of the new candidates of a list
+    // is joined in an iteration, and as many reverse ones
+    const size_t num_samples = (k + 1) / 2;
+    std::vector<std::vector<size_t>> new_lists(m), old_lists(m);
+    std::vector<std::vector<size_t>> reverse_new(m), reverse_old(m);
+    for (size_t iteration = 0; iteration < num_iterations; iteration++)
+    {
+      // The new candidates are joined once
+      ParallelFor(0, m, num_threads,
+                  [&](size_t u, size_t)
+                  {
+                    new_lists[u].clear();
+                    old_lists[u].clear();
+                    NNDescentCandidate *candidates = pool.data() + u * S * k;
+                    size_t sampled                 = 0;
+                    for (size_t j = 0; j < S * k; j++)
+                    {
+                      if (j % k == 0) sampled = 0;
+                      if (candidates[j].id == (tableint)-1) continue;
+                      if (!candidates[j].is_new)
+                      {
+                        old_lists[u].push_back(candidates[j].id);
+                      }
+                      else if (sampled < num_samples)
+                      {
+                        new_lists[u].push_back(candidates[j].id);
+                        candidates[j].is_new = false;
+                        sampled++;
+                      }
+                    }
+                  });
+      for (size_t u = 0; u < m; u++)
+      {
+        reverse_new[u].clear();
+        reverse_old[u].clear();
+      }
+      for (size_t u = 0; u < m; u++)
+      {
+        for (size_t v : new_lists[u])
+        {
+          if (reverse_new[v].size() < S * num_samples)
+            reverse_new[v].push_back(u);
+        }
+        for (size_t v : old_lists[u])
+        {
+          if (reverse_old[v].size() < S * num_samples)
+            reverse_old[v].push_back(u);
+        }
+      }
+
+      std::atomic<size_t> num_updates(0);
+      ParallelFor(
+          0, m, num_threads,
+          [&](size_t u, size_t)
+          {
+            std::vector<size_t> new_nodes = new_lists[u];
+            new_nodes.insert(new_nodes.end(), reverse_new[u].begin(),
+                             reverse_new[u].end());
+            std::sort(new_nodes.begin(), new_nodes.end());
+            new_nodes.erase(std::unique(new_nodes.begin(), new_nodes.end()),
+                            new_nodes.end());
+            std::vector<size_t> old_nodes = old_lists[u];
+            old_nodes.insert(old_nodes.end(), reverse_old[u].begin(),
+                             reverse_old[u].end());
+            std::sort(old_nodes.begin(), old_nodes.end());
+            old_nodes.erase(std::unique(old_nodes.begin(), old_nodes.end()),
+                            old_nodes.end());
+
+            size_t updates = 0;
+            for (size_t i = 0; i < new_nodes.size(); i++)
+            {
+              size_t a = new_nodes[i];
+              auto join = [&](size_t b)
+              {
+                if (a == b) return;
+                dist_t dist = distance(a, b);
+                updates += add_candidate(a, b, dist);
+                updates += add_candidate(b, a, dist);
+              };
+              for (size_t j = i + 1; j < new_nodes.size(); j++)
+              {
+                join(new_nodes[j]);
+              }
+              for (size_t b : old_nodes)
+              {
+                join(b);
+              }
+            }
+            num_updates += updates;
+          });
+
+      if (num_updates < min_update_rate * m * S * k) break;
+    }
+    return pool;
+  }
+
+  // Writes the lists of `level` from the candidates of `NNDescentLevel`: the
+  // links of every slot are selected by the heuristic among the candidates
+  // and the nodes that have the element as a candidate.
+  void LinkNNDescentLevel(const std::vector<tableint> &nodes,
+                          const std::vector<unsigned> &slots, int level,
+                          size_t k, const std::vector<NNDescentCandidate> &pool,
+                          size_t num_threads)
+  {
+    const size_t m = nodes.size();
+    const size_t S = num_segments_;
+    std::vector<std::vector<std::pair<dist_t, tableint>>> reverse(m);
+    for (size_t v = 0; v < m; v++)
+    {
+      const NNDescentCandidate *candidates = pool.data() + v * S * k;
+      for (size_t j = 0; j < S * k; j++)
       {
-        dist_t curdist = fstdistfunc_(GetDataByInternalId(second_pair.second),
-                                      GetDataByInternalId(curent_pair.second),
+        if (candidates[j].id == (tableint)-1) continue;
+        reverse[candidates[j].id].emplace_back(candidates[j].dist, v);
+      }
+    }
+
+    size_t max_links = level ? max_links_per_slot_ : max_links_per_slot_level0_;
+    ParallelFor(
+        0, m, num_threads,
+        [&](size_t u, size_t)
+        {
+          std::vector<std::vector<std::pair<dist_t, tableint>>> slot_candidates(
+              S);
+          const NNDescentCandidate *candidates = pool.data() + u * S * k;
+          for (size_t j = 0; j < S * k; j++)
+          {
+            if (candidates[j].id == (tableint)-1) continue;
+            slot_candidates[j / k].emplace_back(candidates[j].dist,
+                                                nodes[candidates[j].id]);
+          }
+          for (const std::pair<dist_t, tableint> &candidate : reverse[u])
+          {
+            tableint id = nodes[candidate.second];
+            slot_candidates[slots[id]].emplace_back(candidate.first, id);
+          }
+
+          tableint id = nodes[u];
+          std::unique_lock<std::mutex> lock(link_list_locks_[id]);
+          for (unsigned slot_i = 0; slot_i < S; slot_i++)
+          {
+            std::vector<std::pair<dist_t, tableint>> &list =
+                slot_candidates[slot_i];
+            std::sort(list.begin(), list.end(),
+                      [](const std::pair<dist_t, tableint> &a,
+                         const std::pair<dist_t, tableint> &b)
+                      { return a.second < b.second; });
+            list.erase(std::unique(list.begin(), list.end(),
+                                   [](const std::pair<dist_t, tableint> &a,
+                                      const std::pair<dist_t, tableint> &b)
+                                   { return a.second == b.second; }),
+                       list.end());
+
+            std::priority_queue<std::pair<dist_t, tableint>,
+                                std::vector<std::pair<dist_t, tableint>>,
+                                CompareByFirst>
+                top_candidates(list.begin(), list.end());
+            GetNeighborsByHeuristic2(top_candidates, max_links);
+
+            std::vector<tableint> links(top_candidates.size());
+            std::vector<dist_t> dists(top_candidates.size());
+            for (int i = (int)top_candidates.size() - 1; i >= 0; i--)
+            {
+              dists[i] = top_candidates.top().first;
+              links[i] = top_candidates.top().second;
+              top_candidates.pop();
+            }
+            SetLinks(id, level, slot_i, links, dists);
+          }
+        });
+  }
+
+  // Sets up the node of a new element of level `curlevel`, with empty links.
+  // The caller must hold the lock of the element.
+  void InitElement(tableint cur_c, const void *data_point, labeltype label,
+                   Payload payload, int curlevel)
+  {
+    element_levels_[cur_c] = curlevel;  //每个数据所在的层
+
+    FatNodePtr cur_fat_node =
+        GetFatNodePtrLevel0(cur_c);  //该数据（节点）在大图的第0层的地址
+    {
+      LinkListWriteScope write_scope(link_list_versions_[cur_c]);
+      cur_fat_node.Clear(size_fat_node_level0_);  //将这块地址的内存区清空
+
+      // Initialisation of the data, label, and payload
+      cur_fat_node.set_label(label_offset_, label);
+      cur_fat_node.set_payload(payload_offset_, payload);
+      cur_fat_node.set_data(data_offset_, data_point,
+                            data_size_);  //将data_point插入到第0层
+    }
+
+    // PrintFatNode(cur_c);
+
+    if (curlevel > 0)
+    {
+      link_lists_[cur_c] = (char *)malloc(size_node_ * curlevel +
+                                          1);  // size_node_:所有slot的大小
+      if (link_lists_[cur_c] == nullptr)
+        throw std::runtime_error(
+            "Not enough memory: Insert failed to allocate linklist");
+      memset(link_lists_[cur_c], 0, size_node_ * curlevel + 1);
+      // PrintNode(cur_c, curlevel);
+    }
+    if (link_dists_ != nullptr) AllocLinkDists(cur_c, curlevel);
+
+    // Bitmaps are allocated before the node gets linked, since concurrent
+    // insertions may already refresh them once the node is their neighbor.
+    // They keep their size afterwards, so that searches can read them.
+    global_link_bitmaps_[cur_c] =
+        (Bitmap **)malloc(sizeof(Bitmap *) * (curlevel + 1));
+    for (int level = 0; level <= curlevel; level++)
+    {
+      size_t num_elem_per_slot =
+          1 + (level ? max_links_per_slot_ : max_links_per_slot_level0_);
+      global_link_bitmaps_[cur_c][level] =
+          new Bitmap(num_segments_ * num_elem_per_slot);
+    }
+  }
+
+  // Links a new element into the graph of every slot. The caller must hold the
+  // lock of the element.
+  void LinkElement(tableint cur_c, const void *data_point, int curlevel,
+                   unsigned cur_c_slot)
+  {
+    if (joint_insertion_search_)
+    {
+      LinkElementJoint(cur_c, data_point, curlevel, cur_c_slot);
+      return;
+    }
+
+    // Add connections for every slot
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      LinkElementSlot(cur_c, data_point, curlevel, cur_c_slot, slot_i);
+    }
+  }
+
+  // Links a new element into the graph of `slot_i`. Unless `is_locked`, the
+  // caller does not hold the lock of the element, and the other slots of the
+  // element may be linked concurrently. With `reverse_links`, the reverse
+  // links are collected there instead of being added.
+  void LinkElementSlot(tableint cur_c, const void *data_point, int curlevel,
+                       unsigned cur_c_slot, unsigned slot_i,
+                       bool is_locked                          = true,
+                       std::vector<ReverseLink> *reverse_links = nullptr)
+  {
+    // PrintLockState(cur_c, slot_i, "waiting", "global", -1);
+    std::unique_lock<std::mutex> templock(global_slot_locks_[slot_i]);
+    // PrintLockState(cur_c, slot_i, "got", "global", -1);
+
+    Entrypoint entrypoint = GetSlotEntrypoint(slot_i);  // slot_i中的入口点
+    int maxlevelcopy =
+        entrypoint.level;  // slot_i中入口点所在的层次，即最高层次
+    tableint cur_obj = entrypoint.id;
+
+    // The current object level is not larger than the maximum level, and
+    // the inserted object is not the first object of slot_i. A batch leaves
+    // the entry points to `InsertBatch`.
+    if ((curlevel <= maxlevelcopy && (signed)cur_obj != -1) || reverse_links)
+    {
+      templock.unlock();
+      // PrintLockState(cur_c, slot_i, "release", "global", -1);
+    }
+
+    if ((signed)cur_obj != -1)  // slot_i中已经有入口点
+    {
+      if (curlevel < maxlevelcopy)
+      {
+        // Perform nn search in layers > curlevel
+        cur_obj = GreedySearchSlot(cur_obj, data_point, cur_c, maxlevelcopy,
+                                   curlevel, slot_i);
+      }
+
+      for (int level = std::min(curlevel, maxlevelcopy); level >= 0; level--)
+      {
+        if (level > maxlevelcopy || level < 0)  // possible?
+          throw std::runtime_error("Level error");
+
+        std::priority_queue<std::pair<dist_t, tableint>,
+                            std::vector<std::pair<dist_t, tableint>>,
+                            CompareByFirst>
+            top_candidates = SearchLayerSlotForInsertion(  // level层的结果集
+                cur_obj, data_point, cur_c, level, slot_i,
+                GetEfConstruction(
+                    cur_c_slot,
+                    slot_i));  // cur_obj:data_point的最近邻，data_point:插入点，cur_c:插入点的id
+
+        if (!top_candidates.empty())
+        {
+          cur_obj =
+              MutuallyConnectNewElement(  // cur_obj是next_closet_point，相当于下一层的入口点
+                  slot_i, data_point, cur_c, cur_c_slot, top_candidates,
+                  level, false, is_locked,
+                  reverse_links);  // slot_i和cur_c_slot中不一定一样，是data_point在slot_i中的最近邻集合
+        }
+      }
+    }
+    else if (reverse_links == nullptr)
+    {
+      /* There are no points in slot_i now. */
+
+      // Do nothing for the first element of slot_i
+      if (slot_i == cur_c_slot) SetSlotEntrypoint(slot_i, cur_c, curlevel);
+    }
+
+    if (curlevel > maxlevelcopy && slot_i == cur_c_slot &&
+        reverse_links == nullptr)
+      SetSlotEntrypoint(slot_i, cur_c, curlevel);
+
+    // PrintLockState(cur_c, slot_i, "release", "global", -1);
+  }
+
+  // Links a new element into the graphs of all the slots as `LinkElement`,
+  // but searches the slots together at every level, see
+  // `SearchLayerJointForInsertion`. The caller must hold the lock of the
+  // element.
+  void LinkElementJoint(tableint cur_c, const void *data_point, int curlevel,
+                        unsigned cur_c_slot)
+  {
+    std::vector<tableint> entrypoints(num_segments_);
+    std::vector<int> maxlevels(num_segments_);
+    // As in `LinkElementSlot`, the lock of the slot of the element is kept if
+    // the element becomes its entry point. The slot locks are taken in order.
+    std::unique_lock<std::mutex> entry_lock;
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      std::unique_lock<std::mutex> templock(global_slot_locks_[slot_i]);
+      Entrypoint entrypoint = GetSlotEntrypoint(slot_i);
+      entrypoints[slot_i]   = entrypoint.id;
+      maxlevels[slot_i]     = entrypoint.level;
+      if (slot_i == cur_c_slot && ((signed)entrypoints[slot_i] == -1 ||
+                                   curlevel > maxlevels[slot_i]))
+      {
+        entry_lock = std::move(templock);
+      }
+    }
+
+    // Perform nn search in layers > curlevel, per slot
+    int maxlevel = -1;
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      if ((signed)entrypoints[slot_i] == -1) continue;
+      if (curlevel < maxlevels[slot_i])
+      {
+        entrypoints[slot_i] =
+            GreedySearchSlot(entrypoints[slot_i], data_point, cur_c,
+                             maxlevels[slot_i], curlevel, slot_i);
+      }
+      maxlevel = std::max(maxlevel, maxlevels[slot_i]);
+    }
+
+    std::vector<tableint> level_entrypoints(num_segments_);
+    std::vector<std::pair<dist_t, tableint>> seeds;
+    for (int level = std::min(curlevel, maxlevel); level >= 0; level--)
+    {
+      // Only the slots whose graph reaches the level are searched
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        level_entrypoints[slot_i] =
+            maxlevels[slot_i] >= level ? entrypoints[slot_i] : -1;
+      }
+
+      auto top_candidates = SearchLayerJointForInsertion(
+          level_entrypoints, seeds, data_point, cur_c, cur_c_slot, level);
+
+      // The candidates of the level, with their distances, seed the search of
+      // the level below
+      seeds.clear();
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        if (top_candidates[slot_i].empty()) continue;
+        auto candidates = top_candidates[slot_i];
+        for (; !candidates.empty(); candidates.pop())
+        {
+          seeds.push_back(candidates.top());
+        }
+        entrypoints[slot_i] = MutuallyConnectNewElement(
+            slot_i, data_point, cur_c, cur_c_slot, top_candidates[slot_i],
+            level);
+      }
+    }
+
+    if (entry_lock.owns_lock())
+    {
+      SetSlotEntrypoint(cur_c_slot, cur_c, curlevel);
+    }
+  }
+
+  // Greedy search for the nearest element to `data_point` in the graph of
+  // `slot_i`, from `cur_obj` at `from_level` down to the level above
+  // `to_level`.
+  tableint GreedySearchSlot(tableint cur_obj, const void *data_point,
+                            tableint cur_c, int from_level, int to_level,
+                            unsigned slot_i)
+  {
+    std::vector<tableint> neighbors;
+    dist_t curdist = fstdistfunc_(data_point, GetDataByInternalId(cur_obj),
+                                  dist_func_param_);
+    for (int level = from_level; level > to_level; level--)
+    {
+      bool changed = true;
+      while (changed)
+      {
+        changed = false;
+        ReadLinks(cur_obj, level, slot_i, neighbors);
+
+        for (tableint cand : neighbors)
+        {
+          // Do not include the new inserted point itself as its kNN
+          if (cand == cur_c) continue;
+
+          if (cand < 0 || cand > max_elements_)
+            throw std::runtime_error("cand error");
+          dist_t d = fstdistfunc_(data_point, GetDataByInternalId(cand),
+                                  dist_func_param_);
+          if (d < curdist)
+          {
+            curdist = d;
+            cur_obj = cand;
+            changed = true;
+          }
+        }
+      }
+    }
+    return cur_obj;
+  }
+
+  /*
+   * Replaces the vector of an existing element and repairs the links around
+   * it, in the same way as `updatePoint` of hnswlib:
+   *   1. the elements linking to it (approximated by its one-hop neighbors in
+   *      all slots) rebuild their list of its slot from the one-hop and
+   *      two-hop candidates;
+   *   2. its own list of every slot is rebuilt by a search in that slot.
+   * The global link bitmaps of all the touched elements are recomputed.
+   */
+  void UpdatePoint(const void *data_point, tableint internal_id,
+                   float update_neighbor_probability)
+  {
+    // Take update lock to prevent race conditions on an element with
+    // insertion or update at the same time.
+    std::unique_lock<std::mutex> lock_el_update(
+        link_list_update_locks_[(internal_id & (max_update_element_locks - 1))]);
+
+    {
+      std::unique_lock<std::mutex> lock(link_list_locks_[internal_id]);
+      LinkListWriteScope write_scope(link_list_versions_[internal_id]);
+      GetMutableFatNodePtrLevel0(internal_id)
+          .set_data(data_offset_, data_point, data_size_);
+
+      // The distances of the links to the element are refreshed in the lists
+      // repaired below, and not trusted by the searches in the others
+      if (link_dists_ != nullptr)
+      {
+        updated_flags_[internal_id] = true;
+        ComputeLinkDists(internal_id);
+      }
+    }
+
+    // If the graph just contains the single element, there is nothing to link
+    if (cur_element_count_ == 1) return;
+
+    int elem_level     = element_levels_[internal_id];
+    unsigned elem_slot = QueryExtension::ComputeSlotIdx(
+        GetPayloadByInternalId(internal_id), slot_ranges_);
+    std::uniform_real_distribution<float> distribution(0.0, 1.0);
+    std::unordered_set<tableint> touched;
+
+    for (int level = 0; level <= elem_level; level++)
+    {
+      // Only elements of `elem_slot` are candidates for the lists that link
+      // to the updated element
+      std::unordered_set<tableint> s_cand;
+      std::unordered_set<tableint> s_neigh;
+
+      std::vector<tableint> list_one_hop;
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        std::vector<tableint> slot_links =
+            GetConnectionsWithLock(internal_id, level, slot_i);
+        list_one_hop.insert(list_one_hop.end(), slot_links.begin(),
+                            slot_links.end());
+      }
+      if (list_one_hop.empty()) continue;
+
+      s_cand.insert(internal_id);
+      for (tableint el : GetConnectionsWithLock(internal_id, level, elem_slot))
+      {
+        s_cand.insert(el);
+      }
+
+      for (tableint el_one_hop : list_one_hop)
+      {
+        if (distribution(update_probability_generator_) >
+            update_neighbor_probability)
+          continue;
+
+        s_neigh.insert(el_one_hop);
+        for (tableint el_two_hop :
+             GetConnectionsWithLock(el_one_hop, level, elem_slot))
+        {
+          s_cand.insert(el_two_hop);
+        }
+      }
+
+      size_t link_num_limit =
+          level ? max_links_per_slot_ : max_links_per_slot_level0_;
+      for (tableint neigh : s_neigh)
+      {
+        std::priority_queue<std::pair<dist_t, tableint>,
+                            std::vector<std::pair<dist_t, tableint>>,
+                            CompareByFirst>
+            candidates;
+        size_t size = s_cand.find(neigh) == s_cand.end() ? s_cand.size()
+                                                          : s_cand.size() - 1;
+        size_t elements_to_keep = std::min(ef_construction_, size);
+        for (tableint cand : s_cand)
+        {
+          if (cand == neigh || IsMarkedDeleted(cand)) continue;
+
+          dist_t distance =
+              fstdistfunc_(GetDataByInternalId(neigh),
+                           GetDataByInternalId(cand), dist_func_param_);
+          if (candidates.size() < elements_to_keep)
+          {
+            candidates.emplace(distance, cand);
+          }
+          else if (distance < candidates.top().first)
+          {
+            candidates.pop();
+            candidates.emplace(distance, cand);
+          }
+        }
+
+        // Retrieve neighbours using heuristic and set connections.
+        GetNeighborsByHeuristic2(candidates, link_num_limit);
+
+        {
+          std::unique_lock<std::mutex> lock(link_list_locks_[neigh]);
+          LinkListWriteScope write_scope(link_list_versions_[neigh]);
+          tableint *ll_cur = GetMutableLinks(neigh, level, elem_slot);
+          tableint *data   = ll_cur + 1;
+          dist_t *dists    = GetMutableLinkDists(neigh, level, elem_slot);
+          int indx         = candidates.size() - 1;
+          SetLinkCount(ll_cur, candidates.size());
+          while (indx >= 0)
+          {
+            data[indx] = candidates.top().second;
+            if (dists) dists[1 + indx] = candidates.top().first;
+            candidates.pop();
+            indx--;
+          }
+        }
+        touched.insert(neigh);
+      }
+    }
+
+    RepairConnectionsForUpdate(data_point, internal_id, elem_level, elem_slot);
+
+    // Refresh the global links of the element and of its neighborhood
+    for (int level = 0; level <= elem_level; level++)
+    {
+      std::unordered_set<tableint> level_touched;
+      for (tableint id : touched)
+      {
+        if (element_levels_[id] >= level) level_touched.insert(id);
+      }
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        for (tableint id : GetConnectionsWithLock(internal_id, level, slot_i))
+        {
+          level_touched.insert(id);
+        }
+      }
+      level_touched.insert(internal_id);
+
+      for (tableint id : level_touched)
+      {
+        std::unique_lock<std::mutex> lock(link_list_locks_[id]);
+        RefreshGlobalLinks(id, level);
+      }
+    }
+  }
+
+  // Rebuilds the links of an updated element in every slot.
+  void RepairConnectionsForUpdate(const void *data_point, tableint internal_id,
+                                  int elem_level, unsigned elem_slot)
+  {
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      tableint cur_obj;
+      int maxlevelcopy;
+      {
+        std::unique_lock<std::mutex> templock(global_slot_locks_[slot_i]);
+        Entrypoint entrypoint = GetSlotEntrypoint(slot_i);
+        cur_obj               = entrypoint.id;
+        maxlevelcopy          = entrypoint.level;
+      }
+      if ((signed)cur_obj == -1) continue;
+
+      if (elem_level < maxlevelcopy)
+      {
+        dist_t curdist = fstdistfunc_(data_point, GetDataByInternalId(cur_obj),
+                                      dist_func_param_);
+        std::vector<tableint> neighbors;
+        for (int level = maxlevelcopy; level > elem_level; level--)
+        {
+          bool changed = true;
+          while (changed)
+          {
+            changed = false;
+            ReadLinks(cur_obj, level, slot_i, neighbors);
+            for (tableint cand : neighbors)
+            {
+              dist_t d = fstdistfunc_(data_point, GetDataByInternalId(cand),
                                       dist_func_param_);
+              if (d < curdist)
+              {
+                curdist = d;
+                cur_obj = cand;
+                changed = true;
+              }
+            }
+          }
+        }
+      }
+
+      for (int level = std::min(elem_level, maxlevelcopy); level >= 0; level--)
+      {
+        // The updated element itself is expanded (it may be the slot entry
+        // point) and filtered from the candidates afterwards
+        std::priority_queue<std::pair<dist_t, tableint>,
+                            std::vector<std::pair<dist_t, tableint>>,
+                            CompareByFirst>
+            top_candidates = SearchLayerSlotForInsertion(
+                cur_obj, data_point, -1, level, slot_i,
+                GetEfConstruction(elem_slot, slot_i));
+
+        std::priority_queue<std::pair<dist_t, tableint>,
+                            std::vector<std::pair<dist_t, tableint>>,
+                            CompareByFirst>
+            filtered_top_candidates;
+        while (!top_candidates.empty())
+        {
+          if (top_candidates.top().second != internal_id)
+            filtered_top_candidates.push(top_candidates.top());
+          top_candidates.pop();
+        }
+
+        if (!filtered_top_candidates.empty())
+        {
+          cur_obj = MutuallyConnectNewElement(slot_i, data_point, internal_id,
+                                              elem_slot, filtered_top_candidates,
+                                              level, true);
+        }
+      }
+    }
+  }
+
+  std::vector<tableint> GetConnectionsWithLock(tableint internal_id, int level,
+                                               unsigned slot_i)
+  {
+    std::unique_lock<std::mutex> lock(link_list_locks_[internal_id]);
+    const tableint *links = GetLinks(internal_id, level, slot_i);
+    return std::vector<tableint>(links + 1, links + 1 + GetLinkCount(links));
+  }
+
+  // Replaces the deleted elements in the `slot_i` list of `id` by their own
+  // `slot_i` links. Returns whether the list has changed.
+  bool RepairSlotLinks(tableint id, int level, unsigned slot_i)
+  {
+    std::unordered_set<tableint> s_cand;
+    bool has_deleted = false;
+    for (tableint el : GetConnectionsWithLock(id, level, slot_i))
+    {
+      if (!IsMarkedDeleted(el))
+      {
+        s_cand.insert(el);
+        continue;
+      }
+
+      has_deleted = true;
+      for (tableint el_two_hop : GetConnectionsWithLock(el, level, slot_i))
+      {
+        if (el_two_hop != id && !IsMarkedDeleted(el_two_hop) &&
+            QueryExtension::ComputeSlotIdx(GetPayloadByInternalId(el_two_hop),
+                                           slot_ranges_) == slot_i)
+        {
+          s_cand.insert(el_two_hop);
+        }
+      }
+    }
+    if (!has_deleted) return false;
+
+    std::unique_lock<std::mutex> lock(link_list_locks_[id]);
+    tableint *ll_cur = GetMutableLinks(id, level, slot_i);
+    tableint *data   = ll_cur + 1;
+
+    // Keep the links added by concurrent insertions meanwhile
+    for (size_t j = 0; j < GetLinkCount(ll_cur); j++)
+    {
+      if (!IsMarkedDeleted(data[j])) s_cand.insert(data[j]);
+    }
+
+    std::priority_queue<std::pair<dist_t, tableint>,
+                        std::vector<std::pair<dist_t, tableint>>,
+                        CompareByFirst>
+        candidates;
+    for (tableint cand : s_cand)
+    {
+      candidates.emplace(fstdistfunc_(GetDataByInternalId(id),
+                                      GetDataByInternalId(cand),
+                                      dist_func_param_),
+                         cand);
+    }
+    GetNeighborsByHeuristic2(
+        candidates, level ? max_links_per_slot_ : max_links_per_slot_level0_);
+
+    LinkListWriteScope write_scope(link_list_versions_[id]);
+    dist_t *dists = GetMutableLinkDists(id, level, slot_i);
+    int indx      = candidates.size() - 1;
+    SetLinkCount(ll_cur, candidates.size());
+    while (indx >= 0)
+    {
+      data[indx] = candidates.top().second;
+      if (dists) dists[1 + indx] = candidates.top().first;
+      candidates.pop();
+      indx--;
+    }
+    return true;
+  }
+
+  // Frees the upper level links, their distances and the global link bitmaps
+  // of an element.
+  void FreeElement(tableint internal_id)
+  {
+    if (element_levels_[internal_id] > 0) free(link_lists_[internal_id]);
+    link_lists_[internal_id] = nullptr;
+    if (link_dists_ != nullptr)
+    {
+      free(link_dists_[internal_id]);
+      link_dists_[internal_id] = nullptr;
+    }
+    if (global_link_bitmaps_[internal_id] == nullptr) return;
+    for (int level = 0; level <= element_levels_[internal_id]; level++)
+    {
+      delete global_link_bitmaps_[internal_id][level];
+    }
+    free(global_link_bitmaps_[internal_id]);
+    global_link_bitmaps_[internal_id] = nullptr;
+  }
+
+  // Computes the global links of a new inserted object. Those of its neighbors
+  // are kept up to date by `AddGlobalLink` as the reverse links are added. The
+  // caller must not hold the lock of `obj`.
+  void PruneGlobalLinks(tableint obj, int obj_level)
+  {
+    // The bitmaps of the new inserted object have been allocated in `Insert`
+    std::unique_lock<std::mutex> el_lock(link_list_locks_[obj]);
+    for (int level = 0; level <= obj_level; level++)
+    {
+      RefreshGlobalLinks(obj, level);
+    }
+  }
 
-        if (curdist < dist_to_query)  //相当于选择候选集中彼此相距较远的点
+  // Updates the global link bitmap of `obj` after `new_links`, the `slot_i`
+  // list at `level`, replaced `old_links` by adding `cur_c`. When `cur_c` was
+  // only inserted into the list, the bitmap is shifted and only `cur_c` goes
+  // through the heuristic against the preserved links closer to `obj`: if it
+  // is pruned, the other links keep their state. Otherwise, or when the bitmap
+  // is stale after a retirement, it is recomputed. The caller must hold the
+  // lock of `obj`.
+  void AddGlobalLink(tableint obj, int level, unsigned slot_i, tableint cur_c,
+                     const std::vector<tableint> &old_links,
+                     const std::vector<tableint> &new_links)
+  {
+    auto pos = std::find(new_links.begin(), new_links.end(), cur_c);
+    if (HasStaleGlobalLinks(obj, level) || pos == new_links.end() ||
+        new_links.size() != old_links.size() + 1 ||
+        !std::equal(new_links.begin(), pos, old_links.begin()) ||
+        !std::equal(pos + 1, new_links.end(),
+                    old_links.begin() + (pos - new_links.begin())))
+    {
+      RefreshGlobalLinks(obj, level);
+      return;
+    }
+
+    unsigned num_elem_per_slot =
+        level == 0 ? (1 + max_links_per_slot_ * 2) : (1 + max_links_per_slot_);
+    const size_t n_preserve =
+        level == 0 ? (max_links_per_slot_ * 2) : (max_links_per_slot_);
+
+    // Make room for `cur_c` in the bitmap
+    Bitmap shifted(*global_link_bitmaps_[obj][level]);
+    size_t slot_begin = slot_i * num_elem_per_slot + 1;
+    size_t cur_c_pos  = slot_begin + (pos - new_links.begin());
+    for (size_t i = slot_begin + new_links.size() - 1; i > cur_c_pos; i--)
+    {
+      shifted[i] = shifted[i - 1];
+    }
+    shifted[cur_c_pos] = 0;
+
+    size_t num_total_neighbors = 0;
+    for (unsigned slot_j = 0; slot_j < num_segments_; slot_j++)
+    {
+      num_total_neighbors += GetLinkCount(GetLinks(obj, level, slot_j));
+    }
+    if (num_total_neighbors <= n_preserve)
+    {
+      shifted[cur_c_pos] = 1;
+      SetGlobalLinks(obj, level, shifted);
+      return;
+    }
+    if (num_total_neighbors - 1 <= n_preserve)
+    {
+      // All the links were preserved until now
+      RefreshGlobalLinks(obj, level);
+      return;
+    }
+
+    // The preserved links visited before `cur_c` by `PruneGlobalLinksDetail`
+    // are the same as before adding it
+    const void *query        = GetDataByInternalId(obj);
+    const void *data_c       = GetDataByInternalId(cur_c);
+    const dist_t *slot_dists = GetLinkDists(obj, level, slot_i);
+    dist_t dist_c = slot_dists ? slot_dists[1 + (pos - new_links.begin())]
+                               : fstdistfunc_(query, data_c, dist_func_param_);
+    size_t num_closer = 0;
+    bool is_pruned    = false;
+    for (unsigned slot_j = 0; slot_j < num_segments_ && !is_pruned; slot_j++)
+    {
+      const tableint *linklist = GetLinks(obj, level, slot_j);
+      const tableint *data     = linklist + 1;
+      const dist_t *dists      = GetLinkDists(obj, level, slot_j);
+      size_t count             = GetLinkCount(linklist);
+      for (size_t j = 0; j < count; j++)
+      {
+        if (!shifted[slot_j * num_elem_per_slot + 1 + j]) continue;
+        const void *data_r = GetDataByInternalId(data[j]);
+        dist_t dist_r      = dists ? dists[1 + j]
+                                   : fstdistfunc_(query, data_r,
+                                                  dist_func_param_);
+        if (dist_r > dist_c || (dist_r == dist_c && data[j] < cur_c)) continue;
+
+        num_closer++;
+        if (num_closer >= n_preserve ||
+            global_prune_alpha_ *
+                    fstdistfunc_(data_r, data_c, dist_func_param_) <
+                dist_c)
         {
-          good = false;
+          is_pruned = true;
           break;
         }
       }
-      if (good)
+    }
+
+    if (is_pruned)
+    {
+      SetGlobalLinks(obj, level, shifted);
+    }
+    else
+    {
+      // `cur_c` may prune the farther links
+      RefreshGlobalLinks(obj, level);
+    }
+  }
+
+  // Recomputes the global link bitmap of `obj` at `level` from its slot links.
+  // The caller must hold the lock of `obj`.
+  void RefreshGlobalLinks(tableint obj, int level)
+  {
+    Bitmap prune_mask = PruneGlobalLinksDetail(obj, level);
+    SetGlobalLinks(obj, level, prune_mask);
+  }
+
+  // Overwrites the global link bitmap in place, as searches may be reading it.
+  void SetGlobalLinks(tableint obj, int level, const Bitmap &prune_mask)
+  {
+    Bitmap &bitmap = *global_link_bitmaps_[obj][level];
+    LinkListWriteScope write_scope(link_list_versions_[obj]);
+    std::copy(prune_mask.begin(), prune_mask.end(), bitmap.begin());
+  }
+
+  Bitmap PruneGlobalLinksDetail(tableint obj, int level)
+  {
+    const void *query = GetDataByInternalId(obj);
+    unsigned num_elem_per_slot =
+        level == 0 ? (1 + max_links_per_slot_ * 2) : (1 + max_links_per_slot_);
+    const size_t n_preserve =
+        level == 0 ? (max_links_per_slot_ * 2) : (max_links_per_slot_);
+    unsigned bitmap_size = num_segments_ * num_elem_per_slot;
+    Bitmap result(bitmap_size);
+
+    size_t num_total_neighbors = 0;
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      auto *linklist = GetLinks(obj, level, slot_i);
+      auto count     = GetLinkCount(linklist);
+      for (unsigned j = 0; j < count; j++)
+      {
+        num_total_neighbors += 1;
+        result[slot_i * num_elem_per_slot + 1 + j] = 1;
+      }
+    }
+
+    if (num_total_neighbors <= n_preserve)
+    {
+      return result;
+    }
+    std::fill(result.begin(), result.end(), false);
+
+    // The links with their positions in the bitmap
+    std::vector<std::pair<dist_t, tableint>> candidates;
+    std::vector<unsigned> positions;
+    candidates.reserve(num_total_neighbors);
+    positions.reserve(num_total_neighbors);
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      auto *linklist       = GetLinks(obj, level, slot_i);
+      const tableint *data = linklist + 1;
+      const dist_t *dists  = GetLinkDists(obj, level, slot_i);
+      auto count           = GetLinkCount(linklist);
+      for (unsigned i = 0; i < count; i++)
       {
-        preserve_list.push_back(curent_pair);
+        tableint neighbor_id = data[i];
+        candidates.emplace_back(
+            dists ? dists[1 + i]
+                  : fstdistfunc_(query, GetDataByInternalId(neighbor_id),
+                                 dist_func_param_),
+            neighbor_id);
+        positions.push_back(slot_i * num_elem_per_slot + 1 + i);
       }
     }
 
-    for (auto &pair : preserve_list)
+    std::vector<size_t> order(candidates.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+              { return IsCloserCandidate(candidates[a], candidates[b]); });
+    std::vector<std::pair<dist_t, tableint>> sorted_candidates;
+    sorted_candidates.reserve(order.size());
+    for (size_t i : order)
+    {
+      sorted_candidates.push_back(candidates[i]);
+    }
+
+    std::vector<size_t> preserved;
+    SelectByHeuristic(sorted_candidates, n_preserve, global_prune_alpha_,
+                      preserved);
+    for (size_t i : preserved)
     {
-      auto pos    = bitmap_pos_map[pair.second];
-      result[pos] = 1;
+      result[positions[order[i]]] = 1;
     }
     return result;
   }
 
+  // Selects by the heuristic at most `n_preserve` links of an element among
+  // `selected` and the `count` links in `links`, with their distances.
+  std::vector<std::pair<dist_t, tableint>> MergeLinks(
+      const void *data_point, const std::vector<tableint> &selected,
+      const tableint *links, size_t count, size_t n_preserve)
+  {
+    std::unordered_set<tableint> ids(selected.begin(), selected.end());
+    ids.insert(links, links + count);
+
+    std::priority_queue<std::pair<dist_t, tableint>,
+                        std::vector<std::pair<dist_t, tableint>>,
+                        CompareByFirst>
+        candidates;
+    for (tableint id : ids)
+    {
+      candidates.emplace(
+          fstdistfunc_(data_point, GetDataByInternalId(id), dist_func_param_),
+          id);
+    }
+    GetNeighborsByHeuristic2(candidates, n_preserve);
+
+    std::vector<std::pair<dist_t, tableint>> merged(candidates.size());
+    int indx = candidates.size() - 1;
+    while (indx >= 0)
+    {
+      merged[indx] = candidates.top();
+      candidates.pop();
+      indx--;
+    }
+    return merged;
+  }
+
   void GetNeighborsByHeuristic2(
       std::priority_queue<std::pair<dist_t, tableint>,
                           std::vector<std::pair<dist_t, tableint>>,
@@ -1564,31 +3565,62 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       return;
     }
 
-    std::priority_queue<std::pair<dist_t, tableint>> queue_closest;
-    std::vector<std::pair<dist_t, tableint>> return_list;
-    while (top_candidates.size() > 0)
+    std::vector<std::pair<dist_t, tableint>> candidates;
+    candidates.reserve(top_candidates.size());
+    for (; !top_candidates.empty(); top_candidates.pop())
     {
-      queue_closest.emplace(-top_candidates.top().first,
-                            top_candidates.top().second);  //近的排在前面
-      top_candidates.pop();
+      candidates.push_back(top_candidates.top());
     }
+    std::sort(candidates.begin(), candidates.end(), IsCloserCandidate);
 
-    while (queue_closest.size())
+    std::vector<size_t> selected;
+    SelectByHeuristic(candidates, n_preserve, prune_alpha_, selected);
+    for (size_t i : selected)
     {
-      if (return_list.size() >= n_preserve) break;
-      std::pair<dist_t, tableint> curent_pair =
-          queue_closest.top();  // dist最小的
-      dist_t dist_to_query = -curent_pair.first;
-      queue_closest.pop();
-      bool good = true;
+      top_candidates.push(candidates[i]);
+    }
+  }
 
-      for (std::pair<dist_t, tableint> second_pair : return_list)
-      {
-        dist_t curdist = fstdistfunc_(GetDataByInternalId(second_pair.second),
-                                      GetDataByInternalId(curent_pair.second),
-                                      dist_func_param_);
+  // Orders the candidates of the heuristic by distance, then by decreasing id
+  // as the heaps it used to go through.
+  static bool IsCloserCandidate(const std::pair<dist_t, tableint> &a,
+                                const std::pair<dist_t, tableint> &b)
+  {
+    return a.first < b.first || (a.first == b.first && a.second > b.second);
+  }
 
-        if (curdist < dist_to_query)  //相当于选择候选集中彼此相距较远的点
+  // The heuristic of hnswlib over `candidates` sorted by `IsCloserCandidate`:
+  // keeps in turn the candidates closer to the query than to all the kept
+  // ones, up to `n_preserve`. With `alpha` > 1, the rule of Vamana: only a
+  // kept one closer by a factor `alpha` prunes a candidate. Stores the
+  // positions of the kept candidates in `selected`. The pointers to the kept
+  // vectors are kept aside, so that every check compares the candidate with
+  // them one by one without looking up their ids again, and the vector of the
+  // next candidate is prefetched while checking one.
+  void SelectByHeuristic(
+      const std::vector<std::pair<dist_t, tableint>> &candidates,
+      size_t n_preserve, float alpha, std::vector<size_t> &selected) const
+  {
+    selected.clear();
+    std::vector<const void *> selected_data;
+    selected_data.reserve(n_preserve);
+    for (size_t i = 0; i < candidates.size() && selected.size() < n_preserve;
+         i++)
+    {
+#ifdef USE_SSE
+      if (i + 1 < candidates.size())
+      {
+        _mm_prefetch(
+            (const char *)GetDataByInternalId(candidates[i + 1].second),
+            _MM_HINT_T0);
+      }
+#endif
+      const void *data = GetDataByInternalId(candidates[i].second);
+      bool good        = true;
+      for (const void *other_data : selected_data)
+      {
+        if (alpha * fstdistfunc_(other_data, data, dist_func_param_) <
+            candidates[i].first)
         {
           good = false;
           break;
@@ -1596,14 +3628,10 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       }
       if (good)
       {
-        return_list.push_back(curent_pair);
+        selected.push_back(i);
+        selected_data.push_back(data);
       }
     }
-
-    for (std::pair<dist_t, tableint> curent_pair : return_list)
-    {
-      top_candidates.emplace(-curent_pair.first, curent_pair.second);
-    }
   }
 
   tableint MutuallyConnectNewElement(
@@ -1612,10 +3640,9 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       std::priority_queue<std::pair<dist_t, tableint>,
                           std::vector<std::pair<dist_t, tableint>>,
                           CompareByFirst> &top_candidates,
-      int level)
+      int level, bool is_update = false, bool is_locked = true,
+      std::vector<ReverseLink> *reverse_links = nullptr)
   {
-    size_t link_num_limit =
-        level ? max_links_per_slot_ : max_links_per_slot_level0_;
     GetNeighborsByHeuristic2(
         top_candidates,
         max_links_per_slot_);  //相当于选候选集中彼此相距较远的点
@@ -1626,13 +3653,16 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
           "by the heuristic");
 
     std::vector<tableint> selected_neighbors;
+    std::vector<dist_t> selected_dists;
     selected_neighbors.resize(top_candidates.size());
+    selected_dists.resize(top_candidates.size());
     int i = top_candidates.size() - 1;
     while (i >= 0)
     {
       selected_neighbors[i] =
           top_candidates.top()
               .second;  // selected_neighbors中按距离从小到大排序，selected_neighbors中存放的是id
+      selected_dists[i] = top_candidates.top().first;
       top_candidates.pop();
       --i;
     }
@@ -1642,30 +3672,55 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
 
     // Set links for the new inserted element
     {
+      // The lock of a new inserted element has already been hold in `Insert`
+      std::unique_lock<std::mutex> lock(link_list_locks_[cur_c],
+                                        std::defer_lock);
+      if (is_update || !is_locked) lock.lock();
+      LinkListWriteScope write_scope(link_list_versions_[cur_c]);
+
       tableint *links = GetMutableLinks(
           cur_c, level,
           slot_i);  // cur_c是当前插入的点，在slot_i中应该不存在连接
       tableint *data = links + 1;
+      dist_t *dists  = GetMutableLinkDists(cur_c, level, slot_i);
 
-      if (GetLinkCount(links) > 0)
+      if (GetLinkCount(links) > 0 && !is_update)
       {
-        throw std::runtime_error(
-            "The newly inserted element should have blank link list");
+        if (is_locked)
+          throw std::runtime_error(
+              "The newly inserted element should have blank link list");
+
+        // The slots of the element are linked concurrently, so the list may
+        // already hold reverse links: keep the best of both
+        std::vector<std::pair<dist_t, tableint>> merged =
+            MergeLinks(data_point, selected_neighbors, data,
+                       GetLinkCount(links), max_links_per_slot_);
+        SetLinkCount(links, merged.size());
+        for (size_t idx = 0; idx < merged.size(); idx++)
+        {
+          data[idx] = merged[idx].second;
+          if (dists) dists[1 + idx] = merged[idx].first;
+        }
       }
-      SetLinkCount(
-          links,
-          selected_neighbors
-              .size());  // links对应的内存区的第一个是连接的数量，也就是和cur_c的selected_neighbors的数量
-
-      for (size_t idx = 0; idx < selected_neighbors.size(); idx++)
+      else
       {
-        if (data[idx]) throw std::runtime_error("Possible memory corruption");
-        if (level > element_levels_[selected_neighbors[idx]])
-          throw std::runtime_error(
-              "Trying to make a link on a non-existent level");
+        SetLinkCount(
+            links,
+            selected_neighbors
+                .size());  // links对应的内存区的第一个是连接的数量，也就是和cur_c的selected_neighbors的数量
 
-        data[idx] =
-            selected_neighbors[idx];  //在links中存放当前插入点的邻居节点的id
+        for (size_t idx = 0; idx < selected_neighbors.size(); idx++)
+        {
+          if (data[idx] && !is_update)
+            throw std::runtime_error("Possible memory corruption");
+          if (level > element_levels_[selected_neighbors[idx]])
+            throw std::runtime_error(
+                "Trying to make a link on a non-existent level");
+
+          data[idx] =
+              selected_neighbors[idx];  //在links中存放当前插入点的邻居节点的id
+          if (dists) dists[1 + idx] = selected_dists[idx];
+        }
       }
     }
 
@@ -1676,58 +3731,49 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     {
       tableint neighbor_id = selected_neighbors[idx];
 
-      // PrintLockState(cur_c, cur_c_slot, "waiting", "links", neighbor_id);
-      std::unique_lock<std::mutex> lock(link_list_locks_[neighbor_id]);
-      // PrintLockState(cur_c, cur_c_slot, "got", "links", neighbor_id);
-
-      tableint *ll_other =
-          GetMutableLinks(neighbor_id, level,
-                          cur_c_slot);  // neighbor_id在cur_c_slot中的所有连接
-      size_t sz_link_list_other = GetLinkCount(ll_other);
-      tableint *data            = ll_other + 1;
-
-      if (sz_link_list_other > link_num_limit)
-        throw std::runtime_error("Bad value of sz_link_list_other");
       if (selected_neighbors[idx] == cur_c)
         throw std::runtime_error("Trying to connect an element to itself");
       if (level > element_levels_[selected_neighbors[idx]])
         throw std::runtime_error(
             "Trying to make a link on a non-existent level");
 
-      /* Keep the neighbor links ordered */
-
-      dist_t d_max =
-          fstdistfunc_(GetDataByInternalId(cur_c),
-                       GetDataByInternalId(neighbor_id), dist_func_param_);
-      std::priority_queue<std::pair<dist_t, tableint>,
-                          std::vector<std::pair<dist_t, tableint>>,
-                          CompareByFirst>
-          candidates;
-      candidates.emplace(d_max, cur_c);
-
-      for (size_t j = 0; j < sz_link_list_other; j++)  // neighbor_id的所有连接
+      if (reverse_links)
       {
-        candidates.emplace(
-            fstdistfunc_(GetDataByInternalId(data[j]),
-                         GetDataByInternalId(neighbor_id), dist_func_param_),
-            data[j]);
+        reverse_links->push_back(
+            {neighbor_id, level, cur_c_slot, selected_dists[idx], cur_c});
+        continue;
       }
 
-      // An already fulfilled node
-      if (sz_link_list_other >= link_num_limit)
+      // Select the new list of the neighbor from an optimistic copy, and
+      // write it only if the neighbor has not been written meanwhile
+      std::vector<tableint> links;
+      std::vector<dist_t> dists;
+      unsigned version =
+          ReadLinks(neighbor_id, level, cur_c_slot, links, &dists);
+      std::vector<tableint> old_links(links);
+      bool is_changed = SelectReverseLinks(
+          neighbor_id, cur_c, selected_dists[idx], level, links, dists);
+
+      // PrintLockState(cur_c, cur_c_slot, "waiting", "links", neighbor_id);
+      std::unique_lock<std::mutex> lock(link_list_locks_[neighbor_id]);
+      // PrintLockState(cur_c, cur_c_slot, "got", "links", neighbor_id);
+
+      if (link_list_versions_[neighbor_id].load(std::memory_order_relaxed) !=
+          version)
       {
-        // Heuristic:
-        GetNeighborsByHeuristic2(candidates,
-                                 link_num_limit);  //去掉里面相距较近的点
+        CopyLinks(neighbor_id, level, cur_c_slot, old_links, &dists);
+        links      = old_links;
+        is_changed = SelectReverseLinks(neighbor_id, cur_c, selected_dists[idx],
+                                        level, links, dists);
       }
-
-      int indx = candidates.size() - 1;
-      SetLinkCount(ll_other, candidates.size());
-      while (indx >= 0)
+      if (is_changed)
       {
-        data[indx] = candidates.top().second;
-        candidates.pop();
-        indx--;
+        SetLinks(neighbor_id, level, cur_c_slot, links, dists);
+        if (!defer_global_links_)
+        {
+          AddGlobalLink(neighbor_id, level, cur_c_slot, cur_c, old_links,
+                        links);
+        }
       }
 
       // PrintLockState(cur_c, cur_c_slot, "release", "links", neighbor_id);
@@ -1736,10 +3782,129 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     return next_closest_entry_point;
   }
 
+  // Adds `cur_c` into the `cur_c_slot` list of `neighbor_id`, keeping the list
+  // ordered and pruning it by the heuristic when it is full. The caller must
+  // hold the lock of `neighbor_id`.
+  void AddReverseLink(tableint neighbor_id, tableint cur_c, unsigned cur_c_slot,
+                      int level)
+  {
+    std::vector<tableint> links;
+    std::vector<dist_t> dists;
+    CopyLinks(neighbor_id, level, cur_c_slot, links,
+              &dists);  // neighbor_id在cur_c_slot中的所有连接
+    dist_t cur_c_dist =
+        fstdistfunc_(GetDataByInternalId(cur_c),
+                     GetDataByInternalId(neighbor_id), dist_func_param_);
+    if (SelectReverseLinks(neighbor_id, cur_c, cur_c_dist, level, links,
+                           dists))
+    {
+      SetLinks(neighbor_id, level, cur_c_slot, links, dists);
+    }
+  }
+
+  // Adds `cur_c`, at `cur_c_dist` from `neighbor_id`, into `links`, the list
+  // of `neighbor_id`, as `AddReverseLink`. The distances of the links are
+  // updated along in `dists`, and computed if it is not of the same size as
+  // `links`. Returns whether the list has changed.
+  bool SelectReverseLinks(tableint neighbor_id, tableint cur_c,
+                          dist_t cur_c_dist, int level,
+                          std::vector<tableint> &links,
+                          std::vector<dist_t> &dists)
+  {
+    return SelectReverseLinks(neighbor_id, {{cur_c_dist, cur_c}}, level,
+                              links, dists);
+  }
+
+  // Adds several elements with their distances to `neighbor_id` at once,
+  // running the heuristic once if the list overflows.
+  bool SelectReverseLinks(
+      tableint neighbor_id,
+      const std::vector<std::pair<dist_t, tableint>> &new_links, int level,
+      std::vector<tableint> &links, std::vector<dist_t> &dists)
+  {
+    size_t link_num_limit =
+        level ? max_links_per_slot_ : max_links_per_slot_level0_;
+    size_t sz_link_list_other = links.size();
+
+    if (sz_link_list_other > link_num_limit)
+      throw std::runtime_error("Bad value of sz_link_list_other");
+
+    /* Keep the neighbor links ordered */
+
+    std::vector<tableint> old_links(links);
+    std::priority_queue<std::pair<dist_t, tableint>,
+                        std::vector<std::pair<dist_t, tableint>>,
+                        CompareByFirst>
+        candidates;
+    for (auto &new_link : new_links)
+    {
+      // An updated element may already be linked by the neighbor
+      if (std::find(links.begin(), links.end(), new_link.second) ==
+          links.end())
+        candidates.push(new_link);
+    }
+    if (candidates.empty()) return false;
+
+    bool has_dists = dists.size() == links.size();
+    for (size_t j = 0; j < links.size(); j++)  // neighbor_id的所有连接
+    {
+      candidates.emplace(
+          has_dists ? dists[j]
+                    : fstdistfunc_(GetDataByInternalId(links[j]),
+                                   GetDataByInternalId(neighbor_id),
+                                   dist_func_param_),
+          links[j]);
+    }
+
+    // An already fulfilled node
+    if (candidates.size() > link_num_limit)
+    {
+      // Heuristic:
+      GetNeighborsByHeuristic2(candidates,
+                               link_num_limit);  //去掉里面相距较近的点
+    }
+
+    links.resize(candidates.size());
+    dists.resize(candidates.size());
+    int indx = candidates.size() - 1;
+    while (indx >= 0)
+    {
+      links[indx] = candidates.top().second;
+      dists[indx] = candidates.top().first;
+      candidates.pop();
+      indx--;
+    }
+    // The heuristic may have pruned `cur_c` itself
+    return links != old_links;
+  }
+
+  // Overwrites the `slot_i` list of an element, and the distances of the links
+  // if they are stored. The caller must hold the lock of the element.
+  void SetLinks(tableint internal_id, int level, unsigned slot_i,
+                const std::vector<tableint> &links,
+                const std::vector<dist_t> &dists)
+  {
+    LinkListWriteScope write_scope(link_list_versions_[internal_id]);
+    tableint *ll_cur    = GetMutableLinks(internal_id, level, slot_i);
+    dist_t *link_dists = GetMutableLinkDists(internal_id, level, slot_i);
+    SetLinkCount(ll_cur, links.size());
+    std::copy(links.begin(), links.end(), ll_cur + 1);
+    if (link_dists) std::copy(dists.begin(), dists.end(), link_dists + 1);
+  }
+
+  // The ef of a new element of `elem_slot` in the graph of `slot_i`, see
+  // `set_ef_construction_schedule`.
+  size_t GetEfConstruction(unsigned elem_slot, unsigned slot_i) const
+  {
+    if (ef_construction_by_slots_.empty()) return ef_construction_;
+    return ef_construction_by_slots_[elem_slot * num_segments_ + slot_i];
+  }
+
   std::priority_queue<std::pair<dist_t, tableint>,
                       std::vector<std::pair<dist_t, tableint>>, CompareByFirst>
   SearchLayerSlotForInsertion(tableint entrypoint_id, const void *data_point,
-                              tableint data_id, int layer, unsigned slot_i)
+                              tableint data_id, int layer, unsigned slot_i,
+                              size_t ef)
   {
     VisitedList *vl           = visited_list_pool_->getFreeVisitedList();
     vl_type *visited_array    = vl->mass;
@@ -1763,60 +3928,225 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
         GetPayloadByInternalId(entrypoint_id),
         slot_ranges_);  //上一层的最近邻，也就是入口点，所在的slot难道不是slot_i吗
 
-    if (entrypoint_slot == slot_i && entrypoint_id != data_id)
+    if (entrypoint_slot == slot_i && entrypoint_id != data_id &&
+        !IsMarkedDeleted(entrypoint_id))
+    {
+      top_candidates.emplace(dist, entrypoint_id);
+      lower_bound = dist;
+    }
+
+    candidate_set.emplace(
+        -dist, entrypoint_id);  // candidata_set是候选集，top_candidates是结果集
+
+    visited_array[entrypoint_id] = visited_array_tag;
+
+    std::vector<tableint> neighbors;
+    std::vector<dist_t> link_dists;
+    while (!candidate_set.empty())
+    {
+      std::pair<dist_t, tableint> curr_el_pair =
+          candidate_set.top();  // dist最小的元素
+      if ((-curr_el_pair.first) > lower_bound &&
+          top_candidates.size() == ef)
+      {
+        break;
+      }
+      candidate_set.pop();  //删除第一个元素
+
+      tableint cur_obj = curr_el_pair.second;
+
+      // Do not include the new inserted point itself as its kNN
+      if (cur_obj == data_id) continue;
+
+      ReadLinks(cur_obj, layer, slot_i, neighbors,
+                prune_by_link_dists_ ? &link_dists : nullptr);  //在slot_i中
+      for (size_t j = 0; j < neighbors.size(); j++)
+      {
+        tableint candidate_id = neighbors[j];
+        //                    if (candidate_id == 0) continue;
+
+        if (visited_array[candidate_id] == visited_array_tag) continue;
+        visited_array[candidate_id] = visited_array_tag;
+
+        // The bound only shrinks, so a skipped candidate is never needed
+        if (!link_dists.empty() && top_candidates.size() == ef &&
+            IsLinkBeyondBound(-curr_el_pair.first, link_dists[j],
+                              lower_bound) &&
+            !updated_flags_[candidate_id])
+          continue;
+        const void *curr_obj1 = GetDataByInternalId(candidate_id);
+
+        dist_t dist1 = fstdistfunc_(data_point, curr_obj1, dist_func_param_);
+        if (top_candidates.size() < ef || lower_bound > dist1)
+        {
+          candidate_set.emplace(-dist1, candidate_id);
+
+          // Do not include the new inserted point itself as its kNN, and do
+          // not link to deleted elements (they are only used for routing).
+          // An element whose payload was moved to another slot may still be
+          // linked by the lists of its former slot.
+          if (candidate_id != data_id && !IsMarkedDeleted(candidate_id) &&
+              QueryExtension::ComputeSlotIdx(
+                  GetPayloadByInternalId(candidate_id), slot_ranges_) == slot_i)
+            top_candidates.emplace(dist1, candidate_id);
+
+          if (top_candidates.size() > ef) top_candidates.pop();
+
+          if (!top_candidates.empty()) lower_bound = top_candidates.top().first;
+        }
+      }
+    }
+    visited_list_pool_->releaseVisitedList(vl);
+
+    return top_candidates;
+  }
+
+  /*
+   * `SearchLayerSlotForInsertion` for several slots in one traversal, from the
+   * entry point of every slot (-1 for the slots not searched), with the
+   * candidates of every slot as result, and from `seeds`, elements of known
+   * distance. The slots share the visited elements, and route each other
+   * towards `data_point` while they fill up.
+   */
+  std::vector<std::priority_queue<std::pair<dist_t, tableint>,
+                                  std::vector<std::pair<dist_t, tableint>>,
+                                  CompareByFirst>>
+  SearchLayerJointForInsertion(
+      const std::vector<tableint> &entrypoints,
+      const std::vector<std::pair<dist_t, tableint>> &seeds,
+      const void *data_point, tableint data_id, unsigned data_slot, int layer)
+  {
+    VisitedList *vl           = visited_list_pool_->getFreeVisitedList();
+    vl_type *visited_array    = vl->mass;
+    vl_type visited_array_tag = vl->curV;
+
+    std::vector<std::priority_queue<std::pair<dist_t, tableint>,
+                                    std::vector<std::pair<dist_t, tableint>>,
+                                    CompareByFirst>>
+        top_candidates(num_segments_);
+    std::vector<dist_t> lower_bounds(num_segments_,
+                                     std::numeric_limits<dist_t>::max());
+
+    std::priority_queue<std::pair<dist_t, tableint>,
+                        std::vector<std::pair<dist_t, tableint>>,
+                        CompareByFirst>
+        candidate_set;
+
+    std::vector<unsigned> slots;
+    std::vector<size_t> efs(num_segments_);
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
     {
-      top_candidates.emplace(dist, entrypoint_id);
-      lower_bound = dist;
+      if ((signed)entrypoints[slot_i] != -1) slots.push_back(slot_i);
+      efs[slot_i] = GetEfConstruction(data_slot, slot_i);
     }
 
-    candidate_set.emplace(
-        -dist, entrypoint_id);  // candidata_set是候选集，top_candidates是结果集
-
-    visited_array[entrypoint_id] = visited_array_tag;
+    // Whether an element at `dist` may still be among the candidates of
+    // `slot_i`
+    auto is_open = [&](unsigned slot_i, dist_t dist)
+    {
+      return top_candidates[slot_i].size() < efs[slot_i] ||
+             lower_bounds[slot_i] > dist;
+    };
+    // The search stops at the largest lower bound, once all the slots have
+    // enough candidates
+    dist_t stop_bound     = std::numeric_limits<dist_t>::max();
+    bool is_bound_changed = false;
+
+    // Same conditions as `SearchLayerSlotForInsertion`, for the slot of the
+    // element
+    auto add_candidate = [&](tableint id, dist_t dist)
+    {
+      unsigned slot_i = QueryExtension::ComputeSlotIdx(
+          GetPayloadByInternalId(id), slot_ranges_);
+      if (id == data_id || IsMarkedDeleted(id) ||
+          (signed)entrypoints[slot_i] == -1 || !is_open(slot_i, dist))
+        return;
+      top_candidates[slot_i].emplace(dist, id);
+      if (top_candidates[slot_i].size() > efs[slot_i])
+        top_candidates[slot_i].pop();
+      lower_bounds[slot_i] = top_candidates[slot_i].top().first;
+      is_bound_changed     = true;
+    };
+
+    for (const std::pair<dist_t, tableint> &seed : seeds)
+    {
+      if (visited_array[seed.second] == visited_array_tag) continue;
+      visited_array[seed.second] = visited_array_tag;
+      candidate_set.emplace(-seed.first, seed.second);
+      add_candidate(seed.second, seed.first);
+    }
+    for (unsigned slot_i : slots)
+    {
+      tableint entrypoint_id = entrypoints[slot_i];
+      if (visited_array[entrypoint_id] == visited_array_tag) continue;
+      visited_array[entrypoint_id] = visited_array_tag;
+
+      dist_t dist = fstdistfunc_(
+          data_point, GetDataByInternalId(entrypoint_id), dist_func_param_);
+      candidate_set.emplace(-dist, entrypoint_id);
+      add_candidate(entrypoint_id, dist);
+    }
 
+    std::vector<tableint> neighbors;
+    std::vector<dist_t> link_dists;
     while (!candidate_set.empty())
     {
-      std::pair<dist_t, tableint> curr_el_pair =
-          candidate_set.top();  // dist最小的元素
-      if ((-curr_el_pair.first) > lower_bound &&
-          top_candidates.size() == ef_construction_)
+      std::pair<dist_t, tableint> curr_el_pair = candidate_set.top();
+      dist_t curr_dist                         = -curr_el_pair.first;
+      if (is_bound_changed)
       {
-        break;
+        stop_bound = 0;
+        for (unsigned slot_i : slots)
+        {
+          stop_bound = top_candidates[slot_i].size() < efs[slot_i]
+                           ? std::numeric_limits<dist_t>::max()
+                           : std::max(stop_bound, lower_bounds[slot_i]);
+          if (stop_bound == std::numeric_limits<dist_t>::max()) break;
+        }
+        is_bound_changed = false;
       }
-      candidate_set.pop();  //删除第一个元素
+      if (curr_dist >= stop_bound) break;
+      candidate_set.pop();
 
       tableint cur_obj = curr_el_pair.second;
 
       // Do not include the new inserted point itself as its kNN
       if (cur_obj == data_id) continue;
 
-      std::unique_lock<std::mutex> lock(link_list_locks_[cur_obj]);
-
-      tableint *links = GetMutableLinks(cur_obj, layer, slot_i);  //在slot_i中
-      tableint link_count = *links;
-      tableint *data      = links + 1;
-
-      for (size_t j = 0; j < link_count; j++)
+      // The lists of the other slots only route towards `data_point` while
+      // their slots do not have enough candidates yet
+      unsigned cur_slot = QueryExtension::ComputeSlotIdx(
+          GetPayloadByInternalId(cur_obj), slot_ranges_);
+      for (unsigned slot_i : slots)
       {
-        tableint candidate_id = data[j];
-        //                    if (candidate_id == 0) continue;
-
-        if (visited_array[candidate_id] == visited_array_tag) continue;
-        visited_array[candidate_id] = visited_array_tag;
-        const void *curr_obj1       = GetDataByInternalId(candidate_id);
+        if (slot_i == cur_slot
+                ? !is_open(slot_i, curr_dist)
+                : top_candidates[slot_i].size() >= efs[slot_i])
+          continue;
 
-        dist_t dist1 = fstdistfunc_(data_point, curr_obj1, dist_func_param_);
-        if (top_candidates.size() < ef_construction_ || lower_bound > dist1)
+        ReadLinks(cur_obj, layer, slot_i, neighbors,
+                  prune_by_link_dists_ ? &link_dists : nullptr);
+        for (size_t j = 0; j < neighbors.size(); j++)
         {
-          candidate_set.emplace(-dist1, candidate_id);
-
-          // Do not include the new inserted point itself as its kNN
-          if (candidate_id != data_id)
-            top_candidates.emplace(dist1, candidate_id);
+          tableint candidate_id = neighbors[j];
+          if (visited_array[candidate_id] == visited_array_tag) continue;
+          visited_array[candidate_id] = visited_array_tag;
 
-          if (top_candidates.size() > ef_construction_) top_candidates.pop();
+          // The bound only shrinks, so a skipped candidate is never needed
+          if (!link_dists.empty() &&
+              top_candidates[slot_i].size() == efs[slot_i] &&
+              IsLinkBeyondBound(curr_dist, link_dists[j],
+                                lower_bounds[slot_i]) &&
+              !updated_flags_[candidate_id])
+            continue;
 
-          if (!top_candidates.empty()) lower_bound = top_candidates.top().first;
+          dist_t dist1 = fstdistfunc_(
+              data_point, GetDataByInternalId(candidate_id), dist_func_param_);
+          if (is_open(slot_i, dist1))
+          {
+            candidate_set.emplace(-dist1, candidate_id);
+            add_candidate(candidate_id, dist1);
+          }
         }
       }
     }
@@ -1849,12 +4179,14 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     for (unsigned slot :
          activated_slots)  //找到所有激活的slot中最高层的那个入口点及所在层
     {
-      if ((signed)slot_enterpoint_nodes_[slot] != -1 &&
-          (signed)slot_maxlevels_[slot] >
-              maxlevel)  //该slot中有入口点和最高层次
+      // The entry point and its level are read together, see
+      // `SetSlotEntrypoint`
+      Entrypoint entrypoint = GetSlotEntrypoint(slot);
+      if ((signed)entrypoint.id != -1 &&
+          entrypoint.level > maxlevel)  //该slot中有入口点和最高层次
       {
-        ep_id          = slot_enterpoint_nodes_[slot];
-        maxlevel       = slot_maxlevels_[slot];
+        ep_id          = entrypoint.id;
+        maxlevel       = entrypoint.level;
         is_entry_found = true;
       }
     }
@@ -1873,32 +4205,26 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
 
     dist_t curdist = fstdistfunc_(query_data, GetDataByInternalId(curr_obj),
                                   dist_func_param_);
+    std::vector<tableint> neighbors;
     for (int level = maxlevel; level > 0; level--)
     {
       bool changed = true;
       while (changed)
       {
         changed = false;
-        for (unsigned slot_i : activated_slots)
+        ReadSlotLinks(curr_obj, level, activated_slots, al_per_slot, neighbors);
+        for (tableint cand : neighbors)
         {
-          const tableint *links = GetLinks(curr_obj, level, slot_i);
-          int size              = std::min(GetLinkCount(links), al_per_slot);
-          const tableint *data  = links + 1;
+          if (cand < 0 || cand > max_elements_)
+            throw std::runtime_error("cand error");
+          dist_t d = fstdistfunc_(query_data, GetDataByInternalId(cand),
+                                  dist_func_param_);
 
-          for (int j = 0; j < size; j++)
+          if (d < curdist)
           {
-            tableint cand = data[j];
-            if (cand < 0 || cand > max_elements_)
-              throw std::runtime_error("cand error");
-            dist_t d = fstdistfunc_(query_data, GetDataByInternalId(cand),
-                                    dist_func_param_);
-
-            if (d < curdist)
-            {
-              curdist  = d;
-              curr_obj = cand;
-              changed  = true;
-            }
+            curdist  = d;
+            curr_obj = cand;
+            changed  = true;
           }
         }
       }
@@ -1932,7 +4258,8 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
         fstdistfunc_(data_point, GetDataByInternalId(ep_id), dist_func_param_);
 
     if (QueryExtension::IsPayloadQualified(GetPayloadByInternalId(ep_id),
-                                           payload_query))
+                                           payload_query) &&
+        !IsMarkedDeleted(ep_id))
     {
       top_ef_results.emplace(dist, ep_id);
     }
@@ -1955,6 +4282,8 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
 
     assert(!candidate_set.empty());
     dist_t lower_bound = INFINITY;
+    std::vector<tableint> neighbors;
+    std::vector<dist_t> link_dists;
     if (candidate_set.empty())
     {
       lower_bound = -candidate_set.top().first;
@@ -1974,37 +4303,38 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       tableint current_node_id = current_node_pair.second;
 
       // Visit graph neighbors
-      for (unsigned slot_i : activated_slots)
+      ReadSlotLinks(current_node_id, 0, activated_slots, al_per_slot, neighbors,
+                    prune_by_link_dists_ ? &link_dists : nullptr);
+      for (size_t j = 0; j < neighbors.size(); j++)
       {
-        const tableint *links = GetLinksLevel0(current_node_id, slot_i);
-        size_t size           = std::min(GetLinkCount(links), al_per_slot);
-        const tableint *data  = links + 1;
-
-        for (size_t j = 0; j < size; j++)
+        tableint candidate_id = neighbors[j];
+        if (!(visited_array[candidate_id] == visited_array_tag))
         {
-          int candidate_id = data[j];
-          if (!(visited_array[candidate_id] == visited_array_tag))
-          {
-            visited_array[candidate_id] = visited_array_tag;
+          visited_array[candidate_id] = visited_array_tag;
+          if (!link_dists.empty() && top_ef_results.size() == ef &&
+              IsLinkBeyondBound(-current_node_pair.first, link_dists[j],
+                                lower_bound) &&
+              !updated_flags_[candidate_id])
+            continue;
+
+          const void *curr_obj1 = GetDataByInternalId(candidate_id);
+          dist_t dist = fstdistfunc_(data_point, curr_obj1, dist_func_param_);
 
-            const void *curr_obj1 = GetDataByInternalId(candidate_id);
-            dist_t dist = fstdistfunc_(data_point, curr_obj1, dist_func_param_);
+          if (top_ef_results.size() < ef || lower_bound > dist)
+          {
+            candidate_set.emplace(-dist, candidate_id);
 
-            if (top_ef_results.size() < ef || lower_bound > dist)
+            if (QueryExtension::IsPayloadQualified(
+                    GetPayloadByInternalId(candidate_id), payload_query) &&
+                !IsMarkedDeleted(candidate_id))
             {
-              candidate_set.emplace(-dist, candidate_id);
-
-              if (QueryExtension::IsPayloadQualified(
-                      GetPayloadByInternalId(candidate_id), payload_query))
-              {
-                top_ef_results.emplace(dist, candidate_id);
-              }
+              top_ef_results.emplace(dist, candidate_id);
+            }
 
-              if (top_ef_results.size() > ef) top_ef_results.pop();
+            if (top_ef_results.size() > ef) top_ef_results.pop();
 
-              if (!top_ef_results.empty())
-                lower_bound = top_ef_results.top().first;
-            }
+            if (!top_ef_results.empty())
+              lower_bound = top_ef_results.top().first;
           }
         }
       }
@@ -2031,12 +4361,17 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     dist_t dist =
         fstdistfunc_(data_point, GetDataByInternalId(ep_id), dist_func_param_);
 
-    top_ef_results.emplace(dist, ep_id);
+    if (!IsMarkedDeleted(ep_id))
+    {
+      top_ef_results.emplace(dist, ep_id);
+    }
     candidate_set.emplace(-dist, ep_id);
     visited_array[ep_id] = visited_array_tag;
 
     assert(!candidate_set.empty());
     dist_t lower_bound = INFINITY;
+    std::vector<tableint> neighbors;
+    std::vector<dist_t> link_dists;
     if (candidate_set.empty())
     {
       lower_bound = -candidate_set.top().first;
@@ -2056,21 +4391,19 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       tableint current_node_id = current_node_pair.second;
 
       // Visit graph neighbors
-      const tableint *linklist =
-          GetLinks(current_node_id, 0, 0);  // curr_obj在level0的全部链表
-      const Bitmap &bitmap = *global_link_bitmaps_[current_node_id][0];
-
-      for (unsigned j = 0; j < bitmap.size(); j++)
+      ReadGlobalLinks(current_node_id, 0, neighbors,
+                      prune_by_link_dists_ ? &link_dists : nullptr);
+      for (size_t j = 0; j < neighbors.size(); j++)
       {
-        if (!bitmap[j])
-        {
-          continue;
-        }
-        int candidate_id = linklist[j];
-
+        tableint candidate_id = neighbors[j];
         if (!(visited_array[candidate_id] == visited_array_tag))
         {
           visited_array[candidate_id] = visited_array_tag;
+          if (!link_dists.empty() && top_ef_results.size() == ef &&
+              IsLinkBeyondBound(-current_node_pair.first, link_dists[j],
+                                lower_bound) &&
+              !updated_flags_[candidate_id])
+            continue;
 
           const void *curr_obj1 = GetDataByInternalId(candidate_id);
           dist_t dist = fstdistfunc_(data_point, curr_obj1, dist_func_param_);
@@ -2079,7 +4412,10 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
           {
             candidate_set.emplace(-dist, candidate_id);
 
-            top_ef_results.emplace(dist, candidate_id);
+            if (!IsMarkedDeleted(candidate_id))
+            {
+              top_ef_results.emplace(dist, candidate_id);
+            }
             if (top_ef_results.size() > ef) top_ef_results.pop();
 
             if (!top_ef_results.empty())
@@ -2225,8 +4561,31 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     return GetFatNodePtrLevel0(internal_id).get_label(label_offset_);
   }
 
+  // The link lists of a retired slot are invalidated by bumping the slot
+  // generation, so a list whose stamped generation differs reads as empty.
   inline const tableint *GetLinks(tableint internal_id, int level,
                                   int slot_i) const
+  {
+    const tableint *links = GetRawLinks(internal_id, level, slot_i);
+    return IsLinkListStale(links, slot_i) ? empty_link_list_ : links;
+  }
+
+  inline const tableint *GetLinksLevel0(tableint internal_id, int slot_i) const
+  {
+    const tableint *links = GetFatNodePtrLevel0(internal_id)
+                                .get_links(size_per_slot_level0_, slot_i);
+    return IsLinkListStale(links, slot_i) ? empty_link_list_ : links;
+  }
+
+  // The lists of all the slots at a level, addressed by the positions of the
+  // global link bitmaps. The generations are not checked.
+  inline const tableint *GetAllLinks(tableint internal_id, int level) const
+  {
+    return GetRawLinks(internal_id, level, 0);
+  }
+
+  inline const tableint *GetRawLinks(tableint internal_id, int level,
+                                     int slot_i) const
   {
     if (level == 0)
       return GetFatNodePtrLevel0(internal_id)
@@ -2235,25 +4594,293 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
       return GetNodePtr(internal_id, level).get_links(size_per_slot_, slot_i);
   }
 
-  inline const tableint *GetLinksLevel0(tableint internal_id, int slot_i) const
+  // A stale list is reset to an empty list of the current generation, see
+  // `ResetStaleGlobalLinks` for its global links.
+  inline tableint *GetMutableLinks(tableint internal_id, int level, int slot_i)
   {
-    return GetFatNodePtrLevel0(internal_id)
-        .get_links(size_per_slot_level0_, slot_i);
+    tableint *links = level == 0 ? GetMutableFatNodePtrLevel0(internal_id)
+                                       .get_mutable_links(size_per_slot_level0_,
+                                                          slot_i)
+                                 : GetMutableNodePtr(internal_id, level)
+                                       .get_mutable_links(size_per_slot_, slot_i);
+    if (IsLinkListStale(links, slot_i))
+    {
+      *links = slot_generations_[slot_i] << kLinkCountBits;
+      ResetStaleGlobalLinks(internal_id, level, slot_i);
+    }
+    return links;
   }
 
-  inline tableint *GetMutableLinks(tableint internal_id, int level, int slot_i)
+  // The bits of a stale list in the global link bitmap are left by a former
+  // generation of the slot. When the list is reset, they are cleared so that
+  // they do not select the new links, and if some were set, the bit at the
+  // position of the count is set instead: the bitmap was pruned by links of
+  // the former generation, and is recomputed by the next `AddGlobalLink`.
+  void ResetStaleGlobalLinks(tableint internal_id, int level, int slot_i)
+  {
+    if (global_link_bitmaps_[internal_id] == nullptr) return;
+    Bitmap &bitmap             = *global_link_bitmaps_[internal_id][level];
+    unsigned num_elem_per_slot = bitmap.size() / num_segments_;
+    auto slot_begin            = bitmap.begin() + slot_i * num_elem_per_slot;
+    auto slot_end              = slot_begin + num_elem_per_slot;
+    if (std::find(slot_begin, slot_end, true) == slot_end) return;
+    std::fill(slot_begin, slot_end, false);
+    *slot_begin = true;
+  }
+
+  // Whether the global link bitmap of an element was pruned by links of a
+  // retired generation of a slot, see `ResetStaleGlobalLinks`.
+  bool HasStaleGlobalLinks(tableint internal_id, int level) const
+  {
+    const tableint *linklist   = GetAllLinks(internal_id, level);
+    const Bitmap &bitmap       = *global_link_bitmaps_[internal_id][level];
+    unsigned num_elem_per_slot = bitmap.size() / num_segments_;
+    if (num_elem_per_slot == 0) return false;
+    for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+    {
+      unsigned slot_begin = slot_i * num_elem_per_slot;
+      if (bitmap[slot_begin]) return true;
+      if (!IsLinkListStale(linklist + slot_begin, slot_i)) continue;
+      auto begin = bitmap.begin() + slot_begin;
+      if (std::find(begin, begin + num_elem_per_slot, true) !=
+          begin + num_elem_per_slot)
+        return true;
+    }
+    return false;
+  }
+
+  inline bool IsLinkListStale(const tableint *links, int slot_i) const
+  {
+    return (*links >> kLinkCountBits) != slot_generations_[slot_i];
+  }
+
+  inline void SetLinkCount(tableint *links, tableint count)
+  {
+    *links = (*links & ~kLinkCountMask) | count;
+  }
+
+  inline tableint GetLinkCount(const tableint *links) const
+  {
+    return *links & kLinkCountMask;
+  }
+
+  // The distances of the links of a list are kept at the same positions as
+  // the links, the first one (of the count) being unused. They are only
+  // stored after `EnableLinkDistances`, otherwise null is returned.
+  inline const dist_t *GetLinkDists(tableint internal_id, int level,
+                                    int slot_i) const
   {
+    if (link_dists_level0_ == nullptr) return nullptr;
     if (level == 0)
-      return GetMutableFatNodePtrLevel0(internal_id)
-          .get_mutable_links(size_per_slot_level0_, slot_i);
+      return link_dists_level0_ +
+             ((size_t)internal_id * num_segments_ + slot_i) *
+                 (1 + max_links_per_slot_level0_);
+    else
+      return link_dists_[internal_id] +
+             ((size_t)(level - 1) * num_segments_ + slot_i) *
+                 (1 + max_links_per_slot_);
+  }
+
+  inline dist_t *GetMutableLinkDists(tableint internal_id, int level,
+                                     int slot_i)
+  {
+    return const_cast<dist_t *>(GetLinkDists(internal_id, level, slot_i));
+  }
+
+  // Allocates the distances of the upper level links of an element.
+  void AllocLinkDists(tableint internal_id, int level)
+  {
+    link_dists_[internal_id] = nullptr;
+    if (level == 0) return;
+    link_dists_[internal_id] = (dist_t *)malloc(
+        sizeof(dist_t) * level * num_segments_ * (1 + max_links_per_slot_));
+    if (link_dists_[internal_id] == nullptr)
+      throw std::runtime_error(
+          "Not enough memory: failed to allocate link distances");
+  }
+
+  // Whether an element at `link_dist` from another one at `dist` from the
+  // query is farther than `bound` from the query, by the triangle inequality
+  // on the square roots of the squared L2 distances.
+  static bool IsLinkBeyondBound(dist_t dist, dist_t link_dist, dist_t bound)
+  {
+    double lower_bound = std::sqrt((double)dist) - std::sqrt((double)link_dist);
+    return lower_bound * lower_bound > bound;
+  }
+
+  /*
+   * The links of an element are written under its lock, and read by the
+   * searches without locking, like a seqlock: a writer keeps the version of
+   * the element odd while writing, and a reader retries its copy of the links
+   * until the version is the same even value before and after the copy. The
+   * copy must not trust what it reads, as it may be torn.
+   */
+  class LinkListWriteScope
+  {
+   public:
+    explicit LinkListWriteScope(std::atomic<unsigned> &version)
+        : version_(version)
+    {
+      version_.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    ~LinkListWriteScope() { version_.fetch_add(1, std::memory_order_release); }
+
+   private:
+    std::atomic<unsigned> &version_;
+  };
+
+  // Returns the version of the copied links.
+  template <typename CopyFunc>
+  unsigned ReadLinksOptimistic(tableint internal_id, CopyFunc copy) const
+  {
+    const std::atomic<unsigned> &version = link_list_versions_[internal_id];
+    while (true)
+    {
+      unsigned before = version.load(std::memory_order_acquire);
+      if (before & 1)
+      {
+        std::this_thread::yield();
+        continue;
+      }
+      copy();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version.load(std::memory_order_relaxed) == before) return before;
+    }
+  }
+
+  // Copies the `slot_i` list of an element, and into `dists` the distances of
+  // the links if they are stored (otherwise it is cleared). The caller must
+  // hold the lock of the element.
+  void CopyLinks(tableint internal_id, int level, unsigned slot_i,
+                 std::vector<tableint> &neighbors,
+                 std::vector<dist_t> *dists = nullptr) const
+  {
+    size_t max_links = level ? max_links_per_slot_ : max_links_per_slot_level0_;
+    const tableint *links = GetLinks(internal_id, level, slot_i);
+    size_t size = std::min<size_t>(GetLinkCount(links), max_links);
+    neighbors.assign(links + 1, links + 1 + size);
+    if (dists == nullptr) return;
+    const dist_t *link_dists = GetLinkDists(internal_id, level, slot_i);
+    if (link_dists)
+      dists->assign(link_dists + 1, link_dists + 1 + size);
     else
-      return GetMutableNodePtr(internal_id, level)
-          .get_mutable_links(size_per_slot_, slot_i);
+      dists->clear();
+  }
+
+  // `CopyLinks` without locking.
+  unsigned ReadLinks(tableint internal_id, int level, unsigned slot_i,
+                     std::vector<tableint> &neighbors,
+                     std::vector<dist_t> *dists = nullptr) const
+  {
+    return ReadLinksOptimistic(internal_id, [&] {
+      CopyLinks(internal_id, level, slot_i, neighbors, dists);
+    });
+  }
+
+  // Copies the first `max_per_slot` links of the given slots of an element,
+  // and their distances as `CopyLinks`.
+  void ReadSlotLinks(tableint internal_id, int level,
+                     const std::vector<unsigned> &slots, size_t max_per_slot,
+                     std::vector<tableint> &neighbors,
+                     std::vector<dist_t> *dists = nullptr) const
+  {
+    max_per_slot = std::min(
+        max_per_slot, level ? max_links_per_slot_ : max_links_per_slot_level0_);
+    ReadLinksOptimistic(internal_id, [&] {
+      neighbors.clear();
+      if (dists) dists->clear();
+      for (unsigned slot_i : slots)
+      {
+        const tableint *links = GetLinks(internal_id, level, slot_i);
+        size_t size = std::min<size_t>(GetLinkCount(links), max_per_slot);
+        neighbors.insert(neighbors.end(), links + 1, links + 1 + size);
+
+        const dist_t *link_dists = GetLinkDists(internal_id, level, slot_i);
+        if (dists && link_dists)
+          dists->insert(dists->end(), link_dists + 1, link_dists + 1 + size);
+      }
+    });
+  }
+
+  // Copies the links of an element selected by its global link bitmap, and
+  // their distances as `CopyLinks`.
+  void ReadGlobalLinks(tableint internal_id, int level,
+                       std::vector<tableint> &neighbors,
+                       std::vector<dist_t> *dists = nullptr) const
+  {
+    ReadLinksOptimistic(internal_id, [&] {
+      neighbors.clear();
+      if (dists) dists->clear();
+      const tableint *linklist   = GetAllLinks(internal_id, level);
+      const dist_t *link_dists   = GetLinkDists(internal_id, level, 0);
+      const Bitmap &bitmap       = *global_link_bitmaps_[internal_id][level];
+      unsigned num_elem_per_slot = bitmap.size() / num_segments_;
+      for (unsigned slot_i = 0; slot_i < num_segments_; slot_i++)
+      {
+        // Skip the lists of a retired slot
+        unsigned slot_begin = slot_i * num_elem_per_slot;
+        if (num_elem_per_slot == 0 ||
+            IsLinkListStale(linklist + slot_begin, slot_i))
+          continue;
+
+        // Bits beyond the count may be left by a former generation
+        unsigned slot_end =
+            slot_begin + 1 +
+            std::min<unsigned>(GetLinkCount(linklist + slot_begin),
+                               num_elem_per_slot - 1);
+        for (unsigned j = slot_begin + 1; j < slot_end; j++)
+        {
+          if (!bitmap[j]) continue;
+          neighbors.push_back(linklist[j]);
+          if (dists && link_dists) dists->push_back(link_dists[j]);
+        }
+      }
+    });
+  }
+
+  // An entry point with its level
+  struct Entrypoint
+  {
+    tableint id;
+    int level;
+  };
+
+  // The entry points are packed with their levels into single words, so that
+  // a search never pairs an entry point with the level of another one, which
+  // may exceed its own.
+  static uint64_t PackEntrypoint(tableint id, int level)
+  {
+    return ((uint64_t)(uint32_t)level << 32) | (uint32_t)id;
+  }
+
+  static Entrypoint UnpackEntrypoint(uint64_t packed)
+  {
+    return {(tableint)(uint32_t)packed, (int)(int32_t)(packed >> 32)};
   }
 
-  inline void SetLinkCount(tableint *links, tableint count) { *links = count; }
+  inline Entrypoint GetGlobalEntrypoint() const
+  {
+    return UnpackEntrypoint(global_entrypoint_.load(std::memory_order_acquire));
+  }
+
+  inline void SetGlobalEntrypoint(tableint id, int level)
+  {
+    global_entrypoint_.store(PackEntrypoint(id, level),
+                             std::memory_order_release);
+  }
+
+  inline Entrypoint GetSlotEntrypoint(unsigned slot_i) const
+  {
+    return UnpackEntrypoint(
+        slot_entrypoints_[slot_i].load(std::memory_order_acquire));
+  }
 
-  inline tableint GetLinkCount(const tableint *links) const { return *links; }
+  inline void SetSlotEntrypoint(unsigned slot_i, tableint id, int level)
+  {
+    slot_entrypoints_[slot_i].store(PackEntrypoint(id, level),
+                                    std::memory_order_release);
+  }
 
   inline tableint GetSkipListNext(tableint obj, int level) const
   {
@@ -2279,6 +4906,186 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     }
   }
 
+  // The word holding the successor of `pred` in a skiplist level; `pred == -1`
+  // stands for the head of the level. An empty level has a head of -1.
+  inline std::atomic<tableint> &GetSkipListSuccessorRef(tableint pred,
+                                                        int level) const
+  {
+    if ((signed)pred == -1)
+      return *reinterpret_cast<std::atomic<tableint> *>(
+          const_cast<tableint *>(&skiplist_heads_[level]));
+    else if (level != 0)
+      return GetNodePtr(pred, level).skiplist_next();
+    else
+      return GetFatNodePtrLevel0(pred).skiplist_next();
+  }
+
+  inline tableint GetSkipListSuccessor(tableint pred, int level) const
+  {
+    return GetSkipListSuccessorRef(pred, level).load(std::memory_order_acquire);
+  }
+
+  inline void SetSkipListSuccessor(tableint pred, int level, tableint next)
+  {
+    GetSkipListSuccessorRef(pred, level).store(next, std::memory_order_release);
+  }
+
+  // The skiplist is ordered by payload, and by decreasing id among equal
+  // payloads, so that every level has the same order.
+  inline bool IsSkipListBefore(tableint other, tableint obj,
+                               Payload payload) const
+  {
+    Payload value = GetPayloadByInternalId(other);
+    return value < payload || (!(payload < value) && other > obj);
+  }
+
+  // Advances `pred` in a skiplist level to the last point before `obj`, and
+  // returns the point following it.
+  tableint FindSkipListPosition(tableint &pred, int level, tableint obj,
+                                Payload payload) const
+  {
+    while (true)
+    {
+      tableint next = GetSkipListSuccessor(pred, level);
+      if ((signed)next == -1 || !IsSkipListBefore(next, obj, payload))
+        return next;
+      pred = next;
+    }
+  }
+
+  /*
+   * Links `obj` into skiplist levels 0~obj_level. The levels are linked from
+   * the bottom up by CAS on the link of the predecessor, so concurrent
+   * insertions only retry when they link after the same point, and a point
+   * found in a level is always linked in the lower ones. The caller must hold
+   * `global_`, shared being enough, and the skiplist must have at least
+   * obj_level + 1 levels.
+   */
+  void LinkSkipList(tableint obj, int obj_level, Payload payload)
+  {
+    std::vector<tableint> preds(obj_level + 1);
+    tableint pred = -1;
+    for (int level = skiplist_heads_.size() - 1; level >= 0; level--)
+    {
+      FindSkipListPosition(pred, level, obj, payload);
+      if (level <= obj_level) preds[level] = pred;
+    }
+
+    for (int level = 0; level <= obj_level; level++)
+    {
+      // Points inserted meanwhile are only linked after the predecessor, so
+      // the search resumes from it after a failed CAS
+      pred = preds[level];
+      while (true)
+      {
+        tableint next = FindSkipListPosition(pred, level, obj, payload);
+        SetSkipListNext(obj, level, next);
+        if (GetSkipListSuccessorRef(pred, level)
+                .compare_exchange_weak(next, obj, std::memory_order_release,
+                                       std::memory_order_relaxed))
+          break;
+      }
+    }
+  }
+
+  // Unlinks `obj` from all its skiplist levels. The caller must hold `global_`
+  // exclusively.
+  void UnlinkSkipList(tableint obj)
+  {
+    Payload payload = GetPayloadByInternalId(obj);
+    int obj_level   = element_levels_[obj];
+
+    tableint pred = -1;
+    for (int level = skiplist_heads_.size() - 1; level >= 0; level--)
+    {
+      tableint next = FindSkipListPosition(pred, level, obj, payload);
+      if (level <= obj_level)
+      {
+        if (next != obj)
+          throw std::runtime_error("The element is not linked in the skiplist");
+        SetSkipListSuccessor(pred, level, GetSkipListNext(obj, level));
+      }
+    }
+  }
+
+  // Builds the skiplist of the new elements 0~n-1 in a single pass over them
+  // sorted in the skiplist order, and sets the global entry point. The
+  // skiplist must be empty.
+  void BuildSkipList(tableint n)
+  {
+    std::vector<tableint> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this](tableint a, tableint b) {
+      return IsSkipListBefore(a, b, GetPayloadByInternalId(b));
+    });
+
+    int max_level = *std::max_element(element_levels_.begin(),
+                                      element_levels_.begin() + n);
+    std::unique_lock<std::shared_mutex> templock(global_);
+    skiplist_heads_.assign(max_level + 1, -1);
+
+    // The last element linked in each level
+    std::vector<tableint> tails(max_level + 1, -1);
+    for (tableint id : order)
+    {
+      for (int level = 0; level <= element_levels_[id]; level++)
+      {
+        SetSkipListNext(id, level, -1);
+        SetSkipListSuccessor(tails[level], level, id);
+        tails[level] = id;
+      }
+    }
+
+    SetGlobalEntrypoint(skiplist_heads_[max_level], max_level);
+  }
+
+  // Finds the element with the highest level in a slot. An element appears in
+  // skiplist levels 0~element level, so the first element of the slot found
+  // from the top level down has the highest level. The caller must hold
+  // `global_`, or the index exclusively.
+  tableint FindSlotEnterpoint(unsigned slot_i)
+  {
+    const Scalar lower = slot_ranges_[slot_i].first;
+    tableint pred      = -1;
+    for (int level = skiplist_heads_.size() - 1; level >= 0; level--)
+    {
+      while (true)
+      {
+        tableint next = GetSkipListSuccessor(pred, level);
+        if ((signed)next == -1) break;
+
+        if (QueryExtension::ComputeSlotIdx(GetPayloadByInternalId(next),
+                                           slot_ranges_) == slot_i)
+          return next;
+        if (!(GetPayloadByInternalId(next) < lower)) break;
+        pred = next;
+      }
+    }
+    return -1;
+  }
+
+  // The element with the highest level in the skiplist. The caller must hold
+  // `global_`, or the index exclusively.
+  tableint FindGlobalEnterpoint() const
+  {
+    for (int level = skiplist_heads_.size() - 1; level >= 0; level--)
+    {
+      if ((signed)skiplist_heads_[level] != -1) return skiplist_heads_[level];
+    }
+    return -1;
+  }
+
+  tableint GetInternalIdByLabel(labeltype label)
+  {
+    std::unique_lock<std::mutex> lock_table(cur_element_count_guard_);
+    auto search = label_lookup_.find(label);
+    if (search == label_lookup_.end())
+    {
+      throw std::runtime_error("Label not found");
+    }
+    return search->second;
+  }
+
   int GetRandomLevel(double reverse_size)
   {
     std::uniform_real_distribution<double> distribution(0.0, 1.0);
@@ -2286,11 +5093,32 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
     return (int)r;
   }
 
+  // Draws the level of a new element, from the seed and its label in a
+  // deterministic build. The caller must hold `cur_element_count_guard_` or
+  // be the only one inserting, as the generator is shared.
+  int GetNewElementLevel(labeltype label)
+  {
+    if (!deterministic_build_) return GetRandomLevel(mult_);
+
+    // splitmix64 of the seeded label, mapped into (0, 1)
+    uint64_t x = random_seed_ + (uint64_t)label * 0x9E3779B97F4A7C15ull;
+    x          = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x          = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    x          = x ^ (x >> 31);
+    double u   = ((x >> 11) + 0.5) / (double)(1ull << 53);
+    return (int)(-log(u) * mult_);
+  }
+
  private:
   ////////////////////////////////////////////////////////////////////////////////
   /// Data attributes
   ///////////////////////////////////////////////////////////////////////////////
   static const tableint max_update_element_locks = 65536;
+  // The link count word of a slot list keeps the count in its lower bits and
+  // the generation of the slot in its upper bits
+  static const int kLinkCountBits               = 16;
+  static const tableint kLinkCountMask          = (1u << kLinkCountBits) - 1;
+  static constexpr tableint empty_link_list_[1] = {0};
 
   /* Core data structures */
 
@@ -2300,18 +5128,33 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   // Usage: Bitmap* map = global_link_bitmaps_[i][j];
   //   Here map is obj i's bitmap at level j.
   Bitmap ***global_link_bitmaps_;
+  // Optional distances of the links, see `GetLinkDists`
+  dist_t *link_dists_level0_ = nullptr;
+  dist_t **link_dists_       = nullptr;
+  bool prune_by_link_dists_  = false;
+  // Elements whose vector was replaced, see `EnableLinkDistances`
+  std::vector<std::atomic<bool>> updated_flags_;
 
   std::vector<int> element_levels_;
   std::vector<tableint> skiplist_heads_;  // every layer has a skiplist entry
+  // Tombstones: deleted elements are skipped in results but kept for routing
+  std::vector<std::atomic<bool>> deleted_flags_;
+  size_t num_deleted_ = 0;
+  // Sliding window: the generation of each slot, and the ids of the retired
+  // elements, which are reused by the next insertions unless they were moved
+  // between slots, see `RetireOldestSlot`
+  std::vector<tableint> slot_generations_;
+  std::vector<tableint> free_ids_;
+  std::vector<tableint> linked_retired_ids_;
+  std::vector<std::atomic<bool>> moved_flags_;
   std::unordered_map<labeltype, tableint> label_lookup_;
   VisitedListPool *visited_list_pool_;
   SlotRanges slot_ranges_;  // typedef std::vector<std::pair<Scalar, Scalar>>
                             // SlotRanges
 
-  tableint global_enterpoint_node_;
-  int global_max_level_;
-  tableint *slot_enterpoint_nodes_;
-  int *slot_maxlevels_;
+  // The entry points with their levels, see `SetGlobalEntrypoint`
+  std::atomic<uint64_t> global_entrypoint_;
+  std::unique_ptr<std::atomic<uint64_t>[]> slot_entrypoints_;
 
   /* Search parameters */
   Optimizer optimizer_;
@@ -2328,12 +5171,32 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
 
   /* Index parameters */
   size_t ef_construction_;
+  // Per pair of slots, see `set_ef_construction_by_slots`
+  std::vector<size_t> ef_construction_by_slots_;
+  // See `set_prune_alpha` and `set_global_prune_alpha`
+  float prune_alpha_        = 1.0f;
+  float global_prune_alpha_ = 1.0f;
+  // The last elements of an interrupted bulk load are not linked yet
+  size_t num_unlinked_ = 0;
+  // The threads and batch size of the bulk load, 0 for the serial one
+  size_t build_threads_    = 1;
+  size_t build_batch_size_ = 0;
+  // See `set_checkpoint`
+  std::string checkpoint_location_;
+  size_t checkpoint_interval_ = 0;
   size_t num_segments_;
   size_t max_links_per_slot_level0_;
   size_t max_links_per_slot_;
 
   size_t max_elements_;
-  size_t cur_element_count_;
+  // Written under `cur_element_count_guard_`, read by the searches without it
+  std::atomic<size_t> cur_element_count_;
+
+  bool defer_global_links_ = false;
+  // Links the slots of a single insertion in parallel, see
+  // `set_insert_threads`
+  std::unique_ptr<WorkerPool> insert_pool_;
+  bool joint_insertion_search_ = false;
 
   double mult_, rev_size_;
 
@@ -2357,6 +5220,8 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   std::mutex cur_element_count_guard_;
 
   std::vector<std::mutex> link_list_locks_;
+  // Searches read the links without locking, see `ReadLinksOptimistic`
+  std::vector<std::atomic<unsigned>> link_list_versions_;
 
   // Locks to prevent race condition during update/insert of an element at same
   // time. Note: Locks for additions can also be used to prevent this race
@@ -2368,10 +5233,15 @@ class HSIG : public HybridIndexInterface<dist_t, QueryExtension>
   void *dist_func_param_;
 
   std::default_random_engine level_generator_;
+  size_t random_seed_       = 100;
+  bool deterministic_build_ = false;
   std::default_random_engine update_probability_generator_;
 
   std::vector<std::mutex> global_slot_locks_;
-  std::mutex global_;
+  mutable std::shared_mutex global_;
+  // Held exclusively while the deleted elements are compacted, and shared by
+  // all the other operations
+  mutable std::shared_mutex index_guard_;
 };
 
 }  // namespace hannlib
\ No newline at end of file
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+
+namespace hannlib
+{
+/*
+ * Asynchronous ingestion into a hybrid index. `Enqueue` copies the element
+ * into a queue and returns at once, while a pool of workers performs the
+ * insertions. Every enqueued element gets a sequence number (starting from 1),
+ * and the searchable watermark is the largest sequence number such that all
+ * the elements up to it have been inserted, and so are visible to searches.
+ *
+ * The index must allow concurrent insertions. An exception thrown by an
+ * insertion is kept and rethrown by `Flush`; the element still counts as
+ * done for the watermark.
+ */
+template <typename dist_t, typename QueryExtension>
+class IngestionQueue
+{
+ public:
+  using Payload = typename QueryExtension::Payload;
+
+  // `max_pending` bounds the number of queued elements (0 means unbounded);
+  // `Enqueue` blocks while the queue is full.
+  IngestionQueue(HybridIndexInterface<dist_t, QueryExtension> *index,
+                 size_t data_size, size_t num_workers, size_t max_pending = 0)
+      : index_(index), data_size_(data_size), max_pending_(max_pending)
+  {
+    if (num_workers == 0) num_workers = std::thread::hardware_concurrency();
+    num_workers = std::max<size_t>(1, num_workers);
+    workers_.reserve(num_workers);
+    for (size_t i = 0; i < num_workers; i++)
+    {
+      workers_.emplace_back([this] { WorkerLoop(); });
+    }
+  }
+
+  IngestionQueue(const IngestionQueue &)            = delete;
+  IngestionQueue &operator=(const IngestionQueue &) = delete;
+
+  // Inserts the pending elements before stopping the workers.
+  ~IngestionQueue()
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      is_stopped_ = true;
+    }
+    queue_not_empty_.notify_all();
+    for (auto &worker : workers_)
+    {
+      worker.join();
+    }
+  }
+
+  // Returns the sequence number of the element.
+  size_t Enqueue(const void *data_point, labeltype label, Payload payload)
+  {
+    Task task;
+    task.data.resize(data_size_);
+    memcpy(task.data.data(), data_point, data_size_);
+    task.label   = label;
+    task.payload = payload;
+
+    size_t seq;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_not_full_.wait(lock, [this] {
+        return max_pending_ == 0 || queue_.size() < max_pending_;
+      });
+      seq      = ++last_enqueued_;
+      task.seq = seq;
+      queue_.push_back(std::move(task));
+    }
+    queue_not_empty_.notify_one();
+    return seq;
+  }
+
+  size_t GetSearchableWatermark() const
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return watermark_;
+  }
+
+  bool IsSearchable(size_t seq) const { return seq <= GetSearchableWatermark(); }
+
+  size_t GetPendingCount() const
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return last_enqueued_ - watermark_;
+  }
+
+  // Waits until the element `seq` is searchable.
+  void WaitFor(size_t seq)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    watermark_advanced_.wait(lock, [this, seq] { return watermark_ >= seq; });
+  }
+
+  // Waits until all the enqueued elements are searchable, and rethrows the
+  // first error of the insertions if any.
+  void Flush()
+  {
+    std::exception_ptr error;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      watermark_advanced_.wait(lock,
+                               [this] { return watermark_ == last_enqueued_; });
+      std::swap(error, first_error_);
+    }
+    if (error) std::rethrow_exception(error);
+  }
+
+ private:
+  struct Task
+  {
+    size_t seq;
+    std::vector<char> data;
+    labeltype label;
+    Payload payload;
+  };
+
+  void WorkerLoop()
+  {
+    while (true)
+    {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_not_empty_.wait(lock,
+                              [this] { return is_stopped_ || !queue_.empty(); });
+        if (queue_.empty()) return;  // Stopped and drained
+        task = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      queue_not_full_.notify_one();
+
+      std::exception_ptr error;
+      try
+      {
+        index_->Insert(task.data.data(), task.label, task.payload);
+      }
+      catch (...)
+      {
+        error = std::current_exception();
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (error && !first_error_) first_error_ = error;
+
+        // Advance the watermark over the contiguous completed elements
+        done_.insert(task.seq);
+        while (!done_.empty() && *done_.begin() == watermark_ + 1)
+        {
+          done_.erase(done_.begin());
+          watermark_++;
+        }
+      }
+      watermark_advanced_.notify_all();
+    }
+  }
+
+  HybridIndexInterface<dist_t, QueryExtension> *index_;
+  size_t data_size_;
+  size_t max_pending_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable queue_not_empty_;
+  std::condition_variable queue_not_full_;
+  std::condition_variable watermark_advanced_;
+  std::deque<Task> queue_;
+  std::set<size_t> done_;  // completed elements beyond the watermark
+  size_t last_enqueued_ = 0;
+  size_t watermark_     = 0;
+  std::exception_ptr first_error_;
+  bool is_stopped_ = false;
+
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace hannlib
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hannlib
+{
+/*
+ * Replacement for the openmp '#pragma omp parallel for' directive, the same
+ * as the one of the python bindings. Processes ids from start (inclusive) to
+ * end (exclusive) with `fn(id, thread_id)`, and rethrows the last exception
+ * thrown by `fn`.
+ */
+template <class Function>
+inline void ParallelFor(size_t start, size_t end, size_t num_threads,
+                        Function fn)
+{
+  if (num_threads == 0)
+  {
+    num_threads = std::thread::hardware_concurrency();
+  }
+
+  if (num_threads == 1)
+  {
+    for (size_t id = start; id < end; id++)
+    {
+      fn(id, 0);
+    }
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  std::atomic<size_t> current(start);
+  std::exception_ptr last_exception = nullptr;
+  std::mutex last_exception_mutex;
+
+  for (size_t thread_id = 0; thread_id < num_threads; ++thread_id)
+  {
+    threads.push_back(std::thread(
+        [&, thread_id]
+        {
+          while (true)
+          {
+            size_t id = current.fetch_add(1);
+            if (id >= end)
+            {
+              break;
+            }
+
+            try
+            {
+              fn(id, thread_id);
+            }
+            catch (...)
+            {
+              std::unique_lock<std::mutex> lock(last_exception_mutex);
+              last_exception = std::current_exception();
+              current        = end;
+              break;
+            }
+          }
+        }));
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  if (last_exception)
+  {
+    std::rethrow_exception(last_exception);
+  }
+}
+
+/*
+ * A persistent pool of threads for short parallel loops, which would not pay
+ * off the creation of threads by `ParallelFor`. The calling thread processes
+ * ids too, so that a loop progresses even when all the workers are busy with
+ * the loops of other callers. Several threads may run loops at the same time.
+ */
+class WorkerPool
+{
+ public:
+  explicit WorkerPool(size_t num_workers)
+  {
+    for (size_t i = 0; i < num_workers; i++)
+    {
+      workers_.emplace_back([this] { WorkerLoop(); });
+    }
+  }
+
+  WorkerPool(const WorkerPool &)            = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  ~WorkerPool()
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      is_stopped_ = true;
+    }
+    job_added_.notify_all();
+    for (auto &worker : workers_)
+    {
+      worker.join();
+    }
+  }
+
+  size_t num_workers() const { return workers_.size(); }
+
+  // Processes ids from start (inclusive) to end (exclusive) with `fn(id)`,
+  // and rethrows the last exception thrown by `fn`.
+  template <class Function>
+  void ParallelFor(size_t start, size_t end, Function fn)
+  {
+    if (start >= end) return;
+
+    auto job  = std::make_shared<Job>();
+    job->fn   = fn;
+    job->next = start;
+    job->end  = end;
+    if (end - start > 1 && !workers_.empty())
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        jobs_.push_back(job);
+      }
+      job_added_.notify_all();
+    }
+
+    RunJob(*job);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_done_.wait(lock, [&] { return job->num_done == end - start; });
+    if (job->last_exception) std::rethrow_exception(job->last_exception);
+  }
+
+ private:
+  struct Job
+  {
+    std::function<void(size_t)> fn;
+    std::atomic<size_t> next;
+    size_t end;
+    std::atomic<bool> failed{false};
+    size_t num_done = 0;  // guarded by mutex_
+    std::exception_ptr last_exception;
+  };
+
+  // Processes ids of the job until none is left. After a failure, the
+  // remaining ids are only counted as done.
+  void RunJob(Job &job)
+  {
+    size_t num_done = 0;
+    std::exception_ptr exception;
+    for (size_t id; (id = job.next.fetch_add(1)) < job.end; num_done++)
+    {
+      if (job.failed) continue;
+      try
+      {
+        job.fn(id);
+      }
+      catch (...)
+      {
+        exception  = std::current_exception();
+        job.failed = true;
+      }
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto it = std::find_if(jobs_.begin(), jobs_.end(),
+                             [&](const std::shared_ptr<Job> &other)
+                             { return other.get() == &job; });
+      if (it != jobs_.end()) jobs_.erase(it);
+      if (exception) job.last_exception = exception;
+      job.num_done += num_done;
+    }
+    job_done_.notify_all();
+  }
+
+  void WorkerLoop()
+  {
+    while (true)
+    {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        job_added_.wait(lock, [this] { return is_stopped_ || !jobs_.empty(); });
+        if (is_stopped_) return;
+        job = jobs_.front();
+      }
+      RunJob(*job);
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable job_added_;
+  std::condition_variable job_done_;
+  std::deque<std::shared_ptr<Job>> jobs_;
+  bool is_stopped_ = false;
+
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace hannlib
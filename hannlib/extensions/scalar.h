@@ -19,17 +19,28 @@ class ScalarRangeExtension
 
   inline static Payload Payload2Scalar(Payload payload) { return payload; }
 
+  /**
+   * @brief Find the slot whose interval contains the payload.
+   *
+   * The ranges are usually sorted, but a sliding window reuses the slots as a
+   * ring, so they are not assumed to be. Payloads below all the intervals
+   * belong to the lowest slot, and the others (including the closed upper end)
+   * to the highest slot.
+   */
   inline static unsigned int ComputeSlotIdx(Payload payload,
                                             const SlotRanges &ranges)
   {
+    unsigned lowest = 0, highest = 0;
     for (unsigned i = 0; i < ranges.size(); i++)
     {
-      if (payload < ranges[i].second)
+      if (payload < ranges[i].second && !(payload < ranges[i].first))
       {
         return i;
       }
+      if (ranges[i].first < ranges[lowest].first) lowest = i;
+      if (!(ranges[i].second < ranges[highest].second)) highest = i;
     }
-    return ranges.size() - 1;
+    return payload < ranges[lowest].first ? lowest : highest;
   }
 
   inline static std::vector<unsigned int> GetActivatedSlotIndices(
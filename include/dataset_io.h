@@ -0,0 +1,366 @@
+// dataset_io.h - Memory-mapped I/O for the FANNS benchmark datasets
+//
+// Zero-copy views over the vector files (fvecs/ivecs/bvecs, and fbin/u8bin
+// with a (num_points, dim) header, which is also the layout of .bin), fast
+// parsers for the attribute and query range text files, and a streaming
+// conversion from the vecs formats to .bin.
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fanns_io {
+
+// Read-only memory map of a whole file. The pages are read on first access,
+// and can be reclaimed by the kernel at any time since they are clean.
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    // `sequential` tells the kernel to read ahead aggressively, for files
+    // that are scanned once in order.
+    explicit MappedFile(const std::string& filename, bool sequential = false) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Error opening file: " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Error reading the size of: " + filename);
+        }
+        size_ = st.st_size;
+        if (size_ > 0) {
+            void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Error mapping file: " + filename);
+            }
+            data_ = static_cast<const char*>(addr);
+            madvise(addr, size_, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+        }
+        ::close(fd);
+    }
+
+    MappedFile(MappedFile&& other) noexcept
+        : data_(other.data_), size_(other.size_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_ != nullptr) munmap(const_cast<char*>(data_), size_);
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // Drops the pages of [offset, offset + length) from the memory of the
+    // process, once a streaming reader is done with them.
+    void release(size_t offset, size_t length) const {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = (offset + page - 1) / page * page;
+        size_t end = std::min(size_, offset + length) / page * page;
+        if (begin < end) {
+            madvise(const_cast<char*>(data_) + begin, end - begin,
+                    MADV_DONTNEED);
+        }
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// A vector of a view, usable like the rows of a vector<vector<T>>.
+template <typename T>
+struct Row {
+    const T* ptr;
+    size_t dim;
+
+    const T* data() const { return ptr; }
+    size_t size() const { return dim; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + dim; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+};
+
+// View of a fvecs (T = float), ivecs (T = int) or bvecs (T = uint8_t) file:
+// every vector is stored after its dimension as an int32. All the vectors
+// must have the same dimension; only the first and the last headers are
+// checked, so that opening the view does not read the whole file. The readers
+// that go through all the vectors check the other headers with `check_dim`,
+// and `check_dims` checks them all at once.
+template <typename T>
+class VecsView {
+public:
+    explicit VecsView(const std::string& filename, bool sequential = false)
+        : file_(filename, sequential), filename_(filename) {
+        if (file_.size() == 0) return;
+        int32_t dim = read_dim(0);
+        if (dim <= 0) {
+            throw std::runtime_error("Invalid dimension in: " + filename);
+        }
+        dim_ = dim;
+        stride_ = sizeof(int32_t) + dim_ * sizeof(T);
+        if (file_.size() % stride_ != 0) {
+            throw std::runtime_error(
+                "Size is not a multiple of the vector size in: " + filename);
+        }
+        num_points_ = file_.size() / stride_;
+        if (read_dim(num_points_ - 1) != dim) {
+            throw std::runtime_error("Vectors of different dimensions in: " +
+                                     filename);
+        }
+    }
+
+    size_t size() const { return num_points_; }
+    bool empty() const { return num_points_ == 0; }
+    size_t dim() const { return dim_; }
+
+    Row<T> operator[](size_t i) const {
+        return {reinterpret_cast<const T*>(file_.data() + i * stride_ +
+                                           sizeof(int32_t)),
+                dim_};
+    }
+
+    const MappedFile& file() const { return file_; }
+    size_t stride() const { return stride_; }
+
+    // Throws if the header of vector i is not the dimension of the file,
+    // since the rows after it would be misaligned.
+    void check_dim(size_t i) const {
+        if (read_dim(i) != (int32_t)dim_) {
+            throw std::runtime_error("Vectors of different dimensions in: " +
+                                     filename_ + " at vector " +
+                                     std::to_string(i));
+        }
+    }
+
+    void check_dims() const {
+        for (size_t i = 0; i < num_points_; i++) check_dim(i);
+    }
+
+private:
+    int32_t read_dim(size_t i) const {
+        int32_t dim;
+        memcpy(&dim, file_.data() + i * stride_, sizeof(int32_t));
+        return dim;
+    }
+
+    MappedFile file_;
+    std::string filename_;
+    size_t num_points_ = 0;
+    size_t dim_ = 0;
+    size_t stride_ = 0;
+};
+
+// View of a fbin (T = float) or u8bin (T = uint8_t) file: the number of
+// vectors and the dimension as uint32, then the vectors without gaps. Unlike
+// the vecs formats, the vectors can be handed to the index in a single block.
+template <typename T>
+class BinView {
+public:
+    explicit BinView(const std::string& filename, bool sequential = false)
+        : file_(filename, sequential) {
+        uint32_t header[2];
+        if (file_.size() < sizeof(header)) {
+            throw std::runtime_error("Missing header in: " + filename);
+        }
+        memcpy(header, file_.data(), sizeof(header));
+        num_points_ = header[0];
+        dim_ = header[1];
+        if (file_.size() != sizeof(header) + num_points_ * dim_ * sizeof(T)) {
+            throw std::runtime_error("Size does not match the header in: " +
+                                     filename);
+        }
+    }
+
+    size_t size() const { return num_points_; }
+    bool empty() const { return num_points_ == 0; }
+    size_t dim() const { return dim_; }
+
+    // All the vectors, one after the other
+    const T* data() const {
+        return reinterpret_cast<const T*>(file_.data() + 2 * sizeof(uint32_t));
+    }
+
+    Row<T> operator[](size_t i) const { return {data() + i * dim_, dim_}; }
+
+    const MappedFile& file() const { return file_; }
+
+private:
+    MappedFile file_;
+    size_t num_points_ = 0;
+    size_t dim_ = 0;
+};
+
+namespace detail {
+
+// Parses a decimal int at `p`, after blanks, and advances `p` past it.
+inline bool parse_int(const char*& p, const char* end, int& value) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p == end || *p < '0' || *p > '9') return false;
+    int64_t v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+        if (v > (int64_t)INT_MAX + 1) return false;
+    }
+    v = negative ? -v : v;
+    if (v > INT_MAX) return false;
+    value = (int)v;
+    return true;
+}
+
+// Skips the blanks before the end of the line, and returns whether the line
+// ends at `p`.
+inline bool at_line_end(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p == end || *p == '\n';
+}
+
+// Calls `parse_line(p, line_end, line_number)` for every line of the file.
+template <typename ParseLine>
+void for_each_line(const std::string& filename, ParseLine parse_line) {
+    MappedFile file(filename, true);
+    const char* p = file.data();
+    const char* end = p + file.size();
+    for (size_t line_number = 1; p < end; line_number++) {
+        const char* line_end =
+            static_cast<const char*>(memchr(p, '\n', end - p));
+        if (line_end == nullptr) line_end = end;
+        parse_line(p, line_end, line_number);
+        p = line_end + 1;
+    }
+}
+
+inline std::runtime_error line_error(const std::string& what,
+                                     size_t line_number) {
+    return std::runtime_error(what + " at line " +
+                              std::to_string(line_number));
+}
+
+}  // namespace detail
+
+// One integer per line, e.g. the attribute of every vector.
+inline std::vector<int> parse_one_int_per_line(const std::string& filename) {
+    std::vector<int> result;
+    detail::for_each_line(
+        filename, [&](const char* p, const char* end, size_t line_number) {
+            int value;
+            if (!detail::parse_int(p, end, value)) {
+                throw detail::line_error("Non-integer or empty line",
+                                         line_number);
+            }
+            if (!detail::at_line_end(p, end)) {
+                throw detail::line_error("More than one value", line_number);
+            }
+            result.push_back(value);
+        });
+    return result;
+}
+
+// Comma-separated integers per line; a line may be empty.
+inline std::vector<std::vector<int>> parse_ints_per_line(
+    const std::string& filename) {
+    std::vector<std::vector<int>> result;
+    detail::for_each_line(
+        filename, [&](const char* p, const char* end, size_t line_number) {
+            std::vector<int> row;
+            while (!detail::at_line_end(p, end)) {
+                if (*p == ',') {
+                    p++;
+                    continue;
+                }
+                int value;
+                if (!detail::parse_int(p, end, value)) {
+                    throw detail::line_error("Invalid integer", line_number);
+                }
+                row.push_back(value);
+                if (!detail::at_line_end(p, end) && *p != ',') {
+                    throw detail::line_error("Invalid integer", line_number);
+                }
+            }
+            result.push_back(std::move(row));
+        });
+    return result;
+}
+
+// One `low-high` range per line, e.g. the filter of every query.
+inline std::vector<std::pair<int, int>> parse_ranges_per_line(
+    const std::string& filename) {
+    std::vector<std::pair<int, int>> result;
+    detail::for_each_line(
+        filename, [&](const char* p, const char* end, size_t line_number) {
+            int low, high;
+            if (!detail::parse_int(p, end, low) || p == end || *p++ != '-' ||
+                !detail::parse_int(p, end, high) ||
+                !detail::at_line_end(p, end)) {
+                throw detail::line_error("Invalid format", line_number);
+            }
+            result.emplace_back(low, high);
+        });
+    return result;
+}
+
+// Converts a vecs file to .bin through a buffer of `chunk_size` vectors,
+// dropping the input pages once copied, so that the memory does not grow
+// with the dataset. Returns the number of vectors and their dimension.
+template <typename T>
+std::pair<size_t, size_t> convert_vecs_to_bin(const std::string& input,
+                                              const std::string& output,
+                                              size_t chunk_size = 65536) {
+    VecsView<T> vectors(input, true);
+    if (vectors.size() > INT_MAX) {
+        throw std::runtime_error("Too many vectors for .bin in: " + input);
+    }
+    std::ofstream file(output, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Error opening file for writing: " + output);
+    }
+    int header[2] = {(int)vectors.size(), (int)vectors.dim()};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    std::vector<T> chunk(std::min(chunk_size, vectors.size()) * vectors.dim());
+    for (size_t begin = 0; begin < vectors.size(); begin += chunk_size) {
+        size_t end = std::min(vectors.size(), begin + chunk_size);
+        for (size_t i = begin; i < end; i++) {
+            vectors.check_dim(i);
+            memcpy(chunk.data() + (i - begin) * vectors.dim(),
+                   vectors[i].data(), vectors.dim() * sizeof(T));
+        }
+        file.write(reinterpret_cast<const char*>(chunk.data()),
+                   (end - begin) * vectors.dim() * sizeof(T));
+        vectors.file().release(begin * vectors.stride(),
+                               (end - begin) * vectors.stride());
+    }
+    if (!file) {
+        throw std::runtime_error("Error writing file: " + output);
+    }
+    return {vectors.size(), vectors.dim()};
+}
+
+}  // namespace fanns_io
@@ -13,83 +13,7 @@
 namespace py = pybind11;
 using namespace pybind11::literals;  // needed to bring in _a literal
 
-/*
- * replacement for the openmp '#pragma omp parallel for' directive
- * only handles a subset of functionality (no reductions etc)
- * Process ids from start (inclusive) to end (EXCLUSIVE)
- *
- * The method is borrowed from nmslib
- */
-template <class Function>
-inline void ParallelFor(size_t start, size_t end, size_t numThreads,
-                        Function fn)
-{
-  if (numThreads <= 0)
-  {
-    numThreads = std::thread::hardware_concurrency();
-  }
-
-  if (numThreads == 1)
-  {
-    for (size_t id = start; id < end; id++)
-    {
-      fn(id, 0);
-    }
-  }
-  else
-  {
-    std::vector<std::thread> threads;
-    std::atomic<size_t> current(start);
-
-    // keep track of exceptions in threads
-    // https://stackoverflow.com/a/32428427/1713196
-    std::exception_ptr lastException = nullptr;
-    std::mutex lastExceptMutex;
-
-    for (size_t threadId = 0; threadId < numThreads; ++threadId)
-    {
-      threads.push_back(std::thread(
-          [&, threadId]
-          {
-            while (true)
-            {
-              size_t id = current.fetch_add(1);
-
-              if ((id >= end))
-              {
-                break;
-              }
-
-              try
-              {
-                fn(id, threadId);
-              }
-              catch (...)
-              {
-                std::unique_lock<std::mutex> lastExcepLock(lastExceptMutex);
-                lastException = std::current_exception();
-                /*
-                 * This will work even when current is the largest value that
-                 * size_t can fit, because fetch_add returns the previous value
-                 * before the increment (what will result in overflow
-                 * and produce 0 instead of current + 1).
-                 */
-                current = end;
-                break;
-              }
-            }
-          }));
-    }
-    for (auto &thread : threads)
-    {
-      thread.join();
-    }
-    if (lastException)
-    {
-      std::rethrow_exception(lastException);
-    }
-  }
-}
+using hannlib::ParallelFor;
 
 inline void AssertTrue(bool expr, const std::string &msg)
 {
@@ -305,6 +229,48 @@ class HybridIndex
     }
   }
 
+  // Bulk loads the vectors into the empty index, see `InsertBatch`.
+  void InsertBatch(py::object data_py_object, py::object scalar_py_object,
+                   py::object ids_ = py::none(), int num_threads = -1,
+                   size_t batch_size = 4096)
+  {
+    AssertIndexInited();
+    std::vector<float> vectors;
+    std::vector<hannlib::labeltype> labels;
+    std::vector<int64_t> scalars;
+    PrepareBatch(data_py_object, scalar_py_object, ids_, vectors, labels,
+                 scalars);
+    if (num_threads <= 0) num_threads = num_threads_default;
+
+    py::gil_scoped_release l;
+    appr_alg->InsertBatch(vectors.data(), labels.data(), scalars.data(),
+                          labels.size(), num_threads, batch_size);
+    cur_l += labels.size();
+    ep_added = true;
+  }
+
+  // Bulk loads the vectors into the empty index, see `BuildByNNDescent`.
+  void BuildByNNDescent(py::object data_py_object, py::object scalar_py_object,
+                        py::object ids_ = py::none(), int num_threads = -1,
+                        size_t num_candidates = 0, size_t num_iterations = 10,
+                        float min_update_rate = 0.001f)
+  {
+    AssertIndexInited();
+    std::vector<float> vectors;
+    std::vector<hannlib::labeltype> labels;
+    std::vector<int64_t> scalars;
+    PrepareBatch(data_py_object, scalar_py_object, ids_, vectors, labels,
+                 scalars);
+    if (num_threads <= 0) num_threads = num_threads_default;
+
+    py::gil_scoped_release l;
+    appr_alg->BuildByNNDescent(vectors.data(), labels.data(), scalars.data(),
+                               labels.size(), num_threads, num_candidates,
+                               num_iterations, min_update_rate);
+    cur_l += labels.size();
+    ep_added = true;
+  }
+
   py::object HybridSearch(py::object query_py_object,
                           py::object ranges_py_object, size_t k = 1)
   {
@@ -666,6 +632,116 @@ class HybridIndex
             data_numpy_d,      // the data pointer
             free_when_done_d));
   }
+  void MarkDeleted(size_t label)
+  {
+    AssertIndexInited();
+    appr_alg->MarkDelete(label);
+  }
+
+  void UnmarkDeleted(size_t label)
+  {
+    AssertIndexInited();
+    appr_alg->UnmarkDelete(label);
+  }
+
+  void UpdateScalar(size_t label, int64_t scalar)
+  {
+    AssertIndexInited();
+    appr_alg->UpdatePayload(label, scalar);
+  }
+
+  void ConsolidateDeletions()
+  {
+    AssertIndexInited();
+    py::gil_scoped_release l;
+    appr_alg->ConsolidateDeletions();
+  }
+
+  void ComputeGlobalLinks(int num_threads = -1)
+  {
+    AssertIndexInited();
+    if (num_threads <= 0) num_threads = num_threads_default;
+    py::gil_scoped_release l;
+    appr_alg->ComputeGlobalLinks(num_threads);
+  }
+
+  void set_defer_global_links(bool defer)
+  {
+    AssertIndexInited();
+    appr_alg->set_defer_global_links(defer);
+  }
+
+  void set_deterministic_build(bool deterministic)
+  {
+    AssertIndexInited();
+    appr_alg->set_deterministic_build(deterministic);
+  }
+
+  void set_insert_threads(size_t num_threads)
+  {
+    AssertIndexInited();
+    appr_alg->set_insert_threads(num_threads);
+  }
+
+  void set_joint_insertion_search(bool joint)
+  {
+    AssertIndexInited();
+    appr_alg->set_joint_insertion_search(joint);
+  }
+
+  void set_ef_construction_schedule(const std::vector<size_t> &efs)
+  {
+    AssertIndexInited();
+    appr_alg->set_ef_construction_schedule(efs);
+  }
+
+  void set_ef_construction_by_slots(const std::vector<size_t> &efs)
+  {
+    AssertIndexInited();
+    appr_alg->set_ef_construction_by_slots(efs);
+  }
+
+  void set_prune_alpha(float alpha)
+  {
+    AssertIndexInited();
+    appr_alg->set_prune_alpha(alpha);
+  }
+
+  void set_global_prune_alpha(float alpha)
+  {
+    AssertIndexInited();
+    appr_alg->set_global_prune_alpha(alpha);
+  }
+
+  void EnableLinkDistances(bool prune_search = false)
+  {
+    AssertIndexInited();
+    if (prune_search && space_name != "l2")
+      throw std::runtime_error(
+          "Search pruning by link distances requires the l2 space");
+    appr_alg->EnableLinkDistances(prune_search);
+  }
+
+  void set_checkpoint(const std::string &location, size_t interval)
+  {
+    AssertIndexInited();
+    appr_alg->set_checkpoint(location, interval);
+  }
+
+  // Finishes the bulk load of a checkpoint loaded by `load_index`
+  void ResumeInsertBatch(int num_threads = 0)
+  {
+    AssertIndexInited();
+    py::gil_scoped_release l;
+    appr_alg->ResumeInsertBatch(std::max(num_threads, 0));
+  }
+
+  size_t RetireOldestSlot(int64_t new_upper_bound)
+  {
+    AssertIndexInited();
+    return appr_alg->RetireOldestSlot(new_upper_bound);
+  }
+
   void SaveIndex(const std::string &path_to_index)
   {
     appr_alg->SaveIndex(path_to_index);
@@ -698,6 +774,12 @@ class HybridIndex
     return appr_alg->get_current_count();
   }
 
+  size_t get_deleted_count() const
+  {
+    AssertIndexInited();
+    return appr_alg->get_deleted_count();
+  }
+
   size_t get_s() const
   {
     AssertIndexInited();
@@ -784,6 +866,59 @@ class HybridIndex
     for (int i = 0; i < dim; i++) norm_array[i] = data[i] * norm;
   }
 
+  // Copies the arguments of a bulk load, normalizing the vectors if needed,
+  // so that the GIL can be released during the load.
+  void PrepareBatch(py::object data_py_object, py::object scalar_py_object,
+                    py::object ids_, std::vector<float> &vectors,
+                    std::vector<hannlib::labeltype> &labels,
+                    std::vector<int64_t> &scalars)
+  {
+    py::array_t<dist_t, py::array::c_style | py::array::forcecast>
+        data_py_array(data_py_object);
+    auto data_buffer = data_py_array.request();
+    if (data_buffer.ndim != 2)
+      throw std::runtime_error("data must be 2d array");
+    size_t rows = data_buffer.shape[0];
+    if (data_buffer.shape[1] != dim)
+      throw std::runtime_error("wrong dimensionality of the vectors");
+
+    py::array_t<int64_t, py::array::c_style | py::array::forcecast>
+        scalar_py_array(scalar_py_object);
+    auto scalar_buffer = scalar_py_array.request();
+    if (scalar_buffer.ndim != 1)
+      throw std::runtime_error("scalar values must be a 1d array");
+    if (scalar_buffer.shape[0] != rows)
+      throw std::runtime_error(
+          "scalar values must be the same as the number of vectors");
+    scalars.assign(scalar_py_array.data(), scalar_py_array.data() + rows);
+
+    labels.resize(rows);
+    if (!ids_.is_none())
+    {
+      py::array_t<size_t, py::array::c_style | py::array::forcecast> items(
+          ids_);
+      auto ids_numpy = items.request();
+      if (ids_numpy.ndim != 1 || ids_numpy.shape[0] != rows)
+        throw std::runtime_error("wrong dimensionality of the labels");
+      for (size_t i = 0; i < rows; i++) labels[i] = items.data()[i];
+    }
+    else
+    {
+      for (size_t i = 0; i < rows; i++) labels[i] = cur_l + i;
+    }
+
+    const float *data = (const float *)data_py_array.data();
+    vectors.resize(rows * dim);
+    for (size_t i = 0; i < rows; i++)
+    {
+      if (normalize)
+        NormalizeVector((float *)data + i * dim, vectors.data() + i * dim);
+      else
+        std::copy(data + i * dim, data + (i + 1) * dim,
+                  vectors.data() + i * dim);
+    }
+  }
+
   void AssertIndexInited() const
   {
     if (appr_alg == nullptr)
@@ -830,6 +965,47 @@ PYBIND11_PLUGIN(hannlib)
       .def("add_items", &HybridIndex<float>::AddItems, py::arg("data"),
            py::arg("scalars"), py::arg("ids") = py::none(),
            py::arg("num_threads") = -1)
+      .def("insert_batch", &HybridIndex<float>::InsertBatch, py::arg("data"),
+           py::arg("scalars"), py::arg("ids") = py::none(),
+           py::arg("num_threads") = -1, py::arg("batch_size") = 4096)
+      .def("build_by_nn_descent", &HybridIndex<float>::BuildByNNDescent,
+           py::arg("data"), py::arg("scalars"), py::arg("ids") = py::none(),
+           py::arg("num_threads") = -1, py::arg("num_candidates") = 0,
+           py::arg("num_iterations") = 10, py::arg("min_update_rate") = 0.001f)
+      .def("resume_insert_batch", &HybridIndex<float>::ResumeInsertBatch,
+           py::arg("num_threads") = 0)
+      .def("mark_deleted", &HybridIndex<float>::MarkDeleted,
+           py::arg("label"))
+      .def("unmark_deleted", &HybridIndex<float>::UnmarkDeleted,
+           py::arg("label"))
+      .def("update_scalar", &HybridIndex<float>::UpdateScalar,
+           py::arg("label"), py::arg("scalar"))
+      .def("consolidate_deletions", &HybridIndex<float>::ConsolidateDeletions)
+      .def("retire_oldest_slot", &HybridIndex<float>::RetireOldestSlot,
+           py::arg("new_upper_bound"))
+      .def("compute_global_links", &HybridIndex<float>::ComputeGlobalLinks,
+           py::arg("num_threads") = -1)
+      .def("set_defer_global_links",
+           &HybridIndex<float>::set_defer_global_links, py::arg("defer"))
+      .def("set_deterministic_build",
+           &HybridIndex<float>::set_deterministic_build,
+           py::arg("deterministic"))
+      .def("set_insert_threads", &HybridIndex<float>::set_insert_threads,
+           py::arg("num_threads"))
+      .def("set_joint_insertion_search",
+           &HybridIndex<float>::set_joint_insertion_search, py::arg("joint"))
+      .def("set_ef_construction_schedule",
+           &HybridIndex<float>::set_ef_construction_schedule, py::arg("efs"))
+      .def("set_ef_construction_by_slots",
+           &HybridIndex<float>::set_ef_construction_by_slots, py::arg("efs"))
+      .def("set_checkpoint", &HybridIndex<float>::set_checkpoint,
+           py::arg("location"), py::arg("interval"))
+      .def("set_prune_alpha", &HybridIndex<float>::set_prune_alpha,
+           py::arg("alpha"))
+      .def("set_global_prune_alpha",
+           &HybridIndex<float>::set_global_prune_alpha, py::arg("alpha"))
+      .def("enable_link_distances", &HybridIndex<float>::EnableLinkDistances,
+           py::arg("prune_search") = false)
       .def("set_ef", &HybridIndex<float>::set_ef, py::arg("ef"))
       .def("set_al", &HybridIndex<float>::set_al, py::arg("al"))
       .def("set_target_recall", &HybridIndex<float>::set_target_recall,
@@ -872,6 +1048,9 @@ PYBIND11_PLUGIN(hannlib)
       .def_property_readonly("element_count",
                              [](const HybridIndex<float> &index)
                              { return index.get_current_count(); })
+      .def_property_readonly("deleted_count",
+                             [](const HybridIndex<float> &index)
+                             { return index.get_deleted_count(); })
       .def_property_readonly("ef_construction",
                              [](const HybridIndex<float> &index)
                              { return index.get_ef_construction(); })
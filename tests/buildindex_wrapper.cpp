@@ -6,11 +6,14 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <numeric>
+#include <memory>
+#include <cstdio>
 #include <cmath>
 #include <chrono>
 #include <thread>
 #include <atomic>
-#include <omp.h>
+#include <sys/stat.h>
 
 #include "../hannlib/api.h"
 #include "../include/fanns_survey_helpers.cpp"
@@ -21,25 +24,9 @@ std::atomic<int> peak_threads(0);
 using namespace std;
 using namespace std::chrono;
 
-// Read .bin format (num_points, dim, then flat vectors)
-pair<vector<vector<float>>, int> read_bin(const string& filename) {
-    ifstream file(filename, ios::binary);
-    if (!file) {
-        cerr << "Error: Unable to open file " << filename << "\n";
-        exit(1);
-    }
-    
-    int num_points, dim;
-    file.read(reinterpret_cast<char*>(&num_points), sizeof(int));
-    file.read(reinterpret_cast<char*>(&dim), sizeof(int));
-    
-    vector<vector<float>> data(num_points, vector<float>(dim));
-    for (int i = 0; i < num_points; i++) {
-        file.read(reinterpret_cast<char*>(data[i].data()), dim * sizeof(float));
-    }
-    
-    file.close();
-    return {data, dim};
+double seconds_since(high_resolution_clock::time_point start) {
+    return duration_cast<duration<double>>(high_resolution_clock::now() -
+                                           start).count();
 }
 
 // Compute slot ranges using equal-frequency partitioning
@@ -101,9 +88,31 @@ vector<pair<int64_t, int64_t>> compute_slot_ranges(const vector<int>& scalars, i
 }
 
 int main(int argc, char** argv) {
-    if (argc != 8) {
+    // Optional flags after the positional arguments
+    int num_threads = thread::hardware_concurrency();
+    string checkpoint;
+    size_t checkpoint_every = 1000000;
+    bool valid_flags = argc >= 8;
+    for (int i = 8; valid_flags && i < argc; i += 2) {
+        string flag = argv[i];
+        if (i + 1 >= argc) {
+            valid_flags = false;
+        } else if (flag == "--threads") {
+            num_threads = stoi(argv[i + 1]);
+        } else if (flag == "--checkpoint") {
+            checkpoint = argv[i + 1];
+        } else if (flag == "--checkpoint-every") {
+            checkpoint_every = stoull(argv[i + 1]);
+        } else {
+            valid_flags = false;
+        }
+    }
+    num_threads = max(1, num_threads);
+
+    if (argc < 8 || !valid_flags) {
         cerr << "Usage: " << argv[0] << " <data.bin> <attribute_values.txt> "
-             << "<output_index> <M> <ef_construction> <num_slots> <random_seed>\n";
+             << "<output_index> <M> <ef_construction> <num_slots> <random_seed>"
+             << " [--threads N] [--checkpoint PATH] [--checkpoint-every N]\n";
         cerr << "\n";
         cerr << "Arguments:\n";
         cerr << "  data.bin            - Input vectors in .bin format\n";
@@ -113,6 +122,10 @@ int main(int argc, char** argv) {
         cerr << "  ef_construction     - Construction ef parameter\n";
         cerr << "  num_slots           - Number of slots for partitioning\n";
         cerr << "  random_seed         - Random seed for index construction\n";
+        cerr << "  --threads N         - Insertion threads (default: all cores)\n";
+        cerr << "  --checkpoint PATH   - Checkpoint file, resumed from if it exists;\n";
+        cerr << "                        makes the build deterministic\n";
+        cerr << "  --checkpoint-every N - Points linked between checkpoints (default: 1000000)\n";
         return 1;
     }
 
@@ -124,10 +137,6 @@ int main(int argc, char** argv) {
     size_t num_slots = stoull(argv[6]);
     size_t random_seed = stoull(argv[7]);
 
-    // Use all available threads for index construction
-    int num_threads = thread::hardware_concurrency();
-    omp_set_num_threads(num_threads);
-    
     cout << "=== UNIFY Index Construction ===" << endl;
     cout << "Data: " << data_bin << endl;
     cout << "Attributes: " << attr_file << endl;
@@ -135,21 +144,33 @@ int main(int argc, char** argv) {
     cout << "Parameters: M=" << M << ", ef_construction=" << ef_construction 
          << ", num_slots=" << num_slots << ", seed=" << random_seed << endl;
     cout << "Threads: " << num_threads << endl;
+    if (!checkpoint.empty()) {
+        cout << "Checkpoint: " << checkpoint << " every " << checkpoint_every
+             << " points" << endl;
+    }
 
     // ========== DATA LOADING (NOT TIMED) ==========
     cout << "\nLoading data..." << endl;
-    auto [data, dim] = read_bin(data_bin);
+    auto load_start = high_resolution_clock::now();
+    // The index reads the vectors once, in order, straight from the mapping
+    fanns_io::BinView<float> data(data_bin, true);
     size_t num_points = data.size();
-    cout << "Loaded " << num_points << " vectors of dimension " << dim << endl;
+    int dim = data.dim();
+    cout << "Mapped " << num_points << " vectors of dimension " << dim << endl;
 
     // Load attribute values
-    vector<int> attributes = read_one_int_per_line(attr_file);
+    vector<int> attributes = fanns_io::parse_one_int_per_line(attr_file);
     if (attributes.size() != num_points) {
         cerr << "Error: Mismatch between data size (" << num_points 
              << ") and attribute size (" << attributes.size() << ")\n";
         return 1;
     }
     cout << "Loaded " << attributes.size() << " attribute values" << endl;
+    vector<int64_t> payloads(attributes.begin(), attributes.end());
+    vector<hannlib::labeltype> labels(num_points);
+    iota(labels.begin(), labels.end(), 0);
+    double load_sec = seconds_since(load_start);
+    cout << "LOAD_TIME_SECONDS: " << load_sec << endl;
 
     // Compute slot ranges (NOT TIMED - preprocessing)
     cout << "\nComputing slot ranges..." << endl;
@@ -170,21 +191,59 @@ int main(int argc, char** argv) {
     
     auto start_time = high_resolution_clock::now();
 
-    // Initialize UNIFY index
+    // Initialize UNIFY index, or resume the build of an existing checkpoint,
+    // which must come from the same data and parameters. The checkpoint
+    // keeps the batch size of the build, and a checkpointed build is
+    // deterministic, so the resumed index does not depend on the threads.
     hannlib::L2Space space(dim);
-    hannlib::ScalarHSIG<float> index(&space, slot_ranges, num_points, M, ef_construction, random_seed);
+    unique_ptr<hannlib::ScalarHSIG<float>> index_ptr;
+    bool resume = !checkpoint.empty() && ifstream(checkpoint).good();
+    if (resume) {
+        index_ptr.reset(new hannlib::ScalarHSIG<float>(&space, checkpoint, false, num_points));
+        const hannlib::ScalarHSIG<float>& loaded = *index_ptr;
+        string mismatch;
+        if (loaded.get_current_count() != num_points) {
+            mismatch = "number of points " + to_string(loaded.get_current_count());
+        } else if (loaded.get_m() != M) {
+            mismatch = "M " + to_string(loaded.get_m());
+        } else if (loaded.get_ef_construction() != ef_construction) {
+            mismatch = "ef_construction " + to_string(loaded.get_ef_construction());
+        } else if (loaded.get_s() != num_slots) {
+            mismatch = "num_slots " + to_string(loaded.get_s());
+        } else if (loaded.get_random_seed() != random_seed) {
+            mismatch = "random_seed " + to_string(loaded.get_random_seed());
+        } else if (loaded.get_slot_ranges() != slot_ranges) {
+            mismatch = "slot ranges, from other attribute values";
+        }
+        if (!mismatch.empty()) {
+            cerr << "Error: Checkpoint " << checkpoint << " was built with "
+                 << mismatch << "; remove it or use the same arguments\n";
+            done_monitoring = true;
+            monitor_thread.join();
+            return 1;
+        }
+        cout << "Resuming from checkpoint " << checkpoint << endl;
+    } else {
+        index_ptr.reset(new hannlib::ScalarHSIG<float>(&space, slot_ranges, num_points, M, ef_construction, random_seed));
+        if (!checkpoint.empty()) index_ptr->set_deterministic_build(true);
+    }
+    hannlib::ScalarHSIG<float>& index = *index_ptr;
+    index.set_checkpoint(checkpoint, checkpoint_every);
     
     // Insert all points with their attributes
-    for (size_t i = 0; i < num_points; i++) {
-        index.Insert(data[i].data(), i, attributes[i]);
-        
-        if ((i + 1) % 10000 == 0) {
-            cout << "  Inserted " << (i + 1) << " / " << num_points << " points" << endl;
-        }
+    if (resume) {
+        index.ResumeInsertBatch(num_threads);
+    } else {
+        index.InsertBatch(data.data(), labels.data(), payloads.data(),
+                          num_points, num_threads);
     }
+    double insert_sec = seconds_since(start_time);
     
     // Save index
+    auto save_start = high_resolution_clock::now();
     index.SaveIndex(output_index);
+    double save_sec = seconds_since(save_start);
+    if (!checkpoint.empty()) remove(checkpoint.c_str());
     
     auto end_time = high_resolution_clock::now();
     
@@ -198,6 +257,16 @@ int main(int argc, char** argv) {
     double build_time_sec = duration_cast<duration<double>>(end_time - start_time).count();
     
     cout << "BUILD_TIME_SECONDS: " << build_time_sec << endl;
+    cout << "INSERT_TIME_SECONDS: " << insert_sec << " ("
+         << num_points / max(insert_sec, 1e-9) << " points/s)" << endl;
+    struct stat index_st;
+    double index_mb = stat(output_index.c_str(), &index_st) == 0
+                          ? index_st.st_size / 1048576.0
+                          : 0;
+    cout << "SAVE_TIME_SECONDS: " << save_sec << " ("
+         << index_mb / max(save_sec, 1e-9) << " MB/s)" << endl;
+    cout << "LOAD_THROUGHPUT: " << data.file().size() / 1048576.0 / max(load_sec, 1e-9)
+         << " MB/s" << endl;
     cout << "PEAK_THREADS: " << peak_threads.load() << endl;
     
     // Memory footprint
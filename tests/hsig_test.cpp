@@ -0,0 +1,720 @@
+// hsig_test.cpp - Round trips of the HSIG index updates and index files
+//
+// Builds small indexes over random vectors, applies the updates of the index
+// and checks that saving and loading, or the update itself, preserves what
+// it claims to. Returns nonzero if any check fails.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../hannlib/api.h"
+
+using namespace std;
+
+using Index = hannlib::ScalarHSIG<float>;
+using Results = vector<vector<hannlib::labeltype>>;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond \
+                 << endl;                                                  \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+const size_t kDim = 16;
+const size_t kNumQueries = 50;
+const size_t kK = 10;
+
+// Random vectors, the payload of label i being 10 * i
+struct Dataset {
+    size_t n;
+    vector<float> vectors;
+    vector<hannlib::labeltype> labels;
+    vector<int64_t> payloads;
+
+    const float* row(size_t i) const { return vectors.data() + i * kDim; }
+};
+
+Dataset make_dataset(size_t n, unsigned seed = 1) {
+    Dataset data;
+    data.n = n;
+    mt19937 gen(seed);
+    uniform_real_distribution<float> uniform(0, 1);
+    data.vectors.resize(n * kDim);
+    for (float& v : data.vectors) v = uniform(gen);
+    for (size_t i = 0; i < n; i++) {
+        data.labels.push_back(i);
+        data.payloads.push_back(10 * i);
+    }
+    return data;
+}
+
+// Slots of equal width over the payloads of the dataset
+hannlib::SlotRanges make_slot_ranges(const Dataset& data, size_t num_slots) {
+    hannlib::SlotRanges ranges;
+    int64_t width = 10 * data.n / num_slots;
+    for (size_t s = 0; s < num_slots; s++) {
+        ranges.emplace_back(s * width, (s + 1) * width);
+    }
+    return ranges;
+}
+
+Index* build_index(hannlib::SpaceInterface<float>* space, const Dataset& data,
+                   size_t num_slots = 4) {
+    Index* index =
+        new Index(space, make_slot_ranges(data, num_slots), data.n, 8, 64);
+    for (size_t i = 0; i < data.n; i++) {
+        index->Insert(data.row(i), data.labels[i], data.payloads[i]);
+    }
+    return index;
+}
+
+// The queries and their payload ranges, the same for every call
+struct Queries {
+    vector<float> vectors;
+    vector<pair<int64_t, int64_t>> ranges;
+};
+
+Queries make_queries(const Dataset& data) {
+    Queries queries;
+    mt19937 gen(7);
+    uniform_real_distribution<float> uniform(0, 1);
+    queries.vectors.resize(kNumQueries * kDim);
+    for (float& v : queries.vectors) v = uniform(gen);
+    for (size_t q = 0; q < kNumQueries; q++) {
+        int64_t a = gen() % (10 * data.n), b = gen() % (10 * data.n);
+        queries.ranges.emplace_back(min(a, b), max(a, b));
+    }
+    return queries;
+}
+
+// The labels found by the hybrid search, or by the exact scan of the payload
+// skiplist, nearest first
+Results search(Index& index, const Queries& queries,
+               bool pre_filtering = false) {
+    index.set_ef(64);
+    Results results;
+    for (size_t q = 0; q < kNumQueries; q++) {
+        const float* query = queries.vectors.data() + q * kDim;
+        auto found = pre_filtering
+                         ? index.PreFiltering(query, kK, queries.ranges[q])
+                         : index.HybridFiltering(query, kK, queries.ranges[q]);
+        vector<hannlib::labeltype> labels;
+        for (; !found.empty(); found.pop()) labels.push_back(found.top().second);
+        reverse(labels.begin(), labels.end());
+        results.push_back(labels);
+    }
+    return results;
+}
+
+// Recall of the results against a scan of the live points in the ranges
+double recall(const Dataset& data, const vector<bool>& alive,
+              const Queries& queries, const Results& results) {
+    size_t hits = 0, total = 0;
+    for (size_t q = 0; q < kNumQueries; q++) {
+        const float* query = queries.vectors.data() + q * kDim;
+        vector<pair<float, size_t>> candidates;
+        for (size_t i = 0; i < data.n; i++) {
+            if (!alive[i] || data.payloads[i] < queries.ranges[q].first ||
+                data.payloads[i] > queries.ranges[q].second) {
+                continue;
+            }
+            float dist = 0;
+            for (size_t j = 0; j < kDim; j++) {
+                float d = query[j] - data.row(i)[j];
+                dist += d * d;
+            }
+            candidates.emplace_back(dist, i);
+        }
+        sort(candidates.begin(), candidates.end());
+        set<size_t> truth;
+        for (size_t i = 0; i < min(kK, candidates.size()); i++) {
+            truth.insert(candidates[i].second);
+        }
+        for (hannlib::labeltype label : results[q]) hits += truth.count(label);
+        total += truth.size();
+    }
+    return total == 0 ? 1.0 : (double)hits / total;
+}
+
+// Whether no result is a dead point
+bool all_alive(const vector<bool>& alive, const Results& results) {
+    for (const auto& labels : results) {
+        for (hannlib::labeltype label : labels) {
+            if (!alive[label]) return false;
+        }
+    }
+    return true;
+}
+
+string read_file(const string& location) {
+    ifstream file(location, ios::binary);
+    return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+Index* save_and_load(Index& index, hannlib::SpaceInterface<float>* space,
+                     const string& location) {
+    index.SaveIndex(location);
+    Index* loaded = new Index(space, location, false, index.get_max_elements());
+    remove(location.c_str());
+    return loaded;
+}
+
+// The tombstones of the deleted points are saved with the index
+void test_tombstones() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    unique_ptr<Index> index(build_index(&space, data));
+    vector<bool> alive(data.n, true);
+    for (size_t i = 0; i < data.n; i += 7) {
+        index->MarkDelete(i);
+        alive[i] = false;
+    }
+    Results before = search(*index, queries);
+    CHECK(all_alive(alive, before));
+
+    unique_ptr<Index> loaded(
+        save_and_load(*index, &space, "hsig_test_tombstones.bin"));
+    CHECK(loaded->get_deleted_count() == index->get_deleted_count());
+    CHECK(search(*loaded, queries) == before);
+    loaded->UnmarkDelete(0);
+    alive[0] = true;
+    CHECK(all_alive(alive, search(*loaded, queries)));
+
+    // An id of the tombstone section, the last one here, beyond the points
+    string location = "hsig_test_tombstones_corrupted.bin";
+    index->SaveIndex(location);
+    {
+        fstream file(location, ios::in | ios::out | ios::binary);
+        file.seekp(-(streamoff)sizeof(hannlib::tableint), ios::end);
+        hannlib::tableint id = data.n;
+        file.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+    bool rejected = false;
+    try {
+        Index corrupted(&space, location, false, data.n);
+    } catch (const runtime_error&) {
+        rejected = true;
+    }
+    remove(location.c_str());
+    CHECK(rejected);
+}
+
+// The points moved to other payloads are found by their new payloads, by
+// the skiplist as well as by the graphs, before and after a round trip
+void test_payload_update() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    unique_ptr<Index> index(build_index(&space, data));
+    vector<bool> alive(data.n, true);
+    for (size_t i = 0; i < data.n; i += 5) {
+        data.payloads[i] = 10 * data.n - 1 - data.payloads[i];
+        index->UpdatePayload(i, data.payloads[i]);
+    }
+    Results exact = search(*index, queries, true);
+    CHECK(recall(data, alive, queries, exact) == 1.0);
+    Results before = search(*index, queries);
+    CHECK(recall(data, alive, queries, before) >= 0.9);
+
+    unique_ptr<Index> loaded(
+        save_and_load(*index, &space, "hsig_test_payload_update.bin"));
+    CHECK(search(*loaded, queries, true) == exact);
+    CHECK(search(*loaded, queries) == before);
+}
+
+// Consolidating the deleted points keeps the recall of the searches, which
+// then survive a round trip of the compacted index
+void test_consolidation() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    unique_ptr<Index> index(build_index(&space, data));
+    vector<bool> alive(data.n, true);
+    for (size_t i = 0; i < data.n; i += 4) {
+        index->MarkDelete(i);
+        alive[i] = false;
+    }
+    double recall_before = recall(data, alive, queries, search(*index, queries));
+
+    bool rejected = false;
+    try {
+        index->ConsolidateDeletions(0);
+    } catch (const runtime_error&) {
+        rejected = true;
+    }
+    CHECK(rejected);
+
+    // A batch larger than the ids repairs them all at once
+    index->ConsolidateDeletions(size_t(1) << 40);
+    CHECK(index->get_deleted_count() == 0);
+    CHECK(index->get_current_count() == data.n - data.n / 4);
+    Results after = search(*index, queries);
+    CHECK(all_alive(alive, after));
+    CHECK(recall(data, alive, queries, after) >= recall_before - 0.02);
+    CHECK(recall(data, alive, queries, search(*index, queries, true)) == 1.0);
+
+    unique_ptr<Index> loaded(
+        save_and_load(*index, &space, "hsig_test_consolidation.bin"));
+    CHECK(search(*loaded, queries) == after);
+}
+
+// Retiring the oldest slot frees the ids of its points, which are saved with
+// the slot generations and reused by the next insertions
+void test_slot_retirement() {
+    const size_t window = 2000, num_slots = 4;
+    Dataset data = make_dataset(window + window / num_slots);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    hannlib::SlotRanges ranges;
+    int64_t width = 10 * window / num_slots;
+    for (size_t s = 0; s < num_slots; s++) {
+        ranges.emplace_back(s * width, (s + 1) * width);
+    }
+    unique_ptr<Index> index(new Index(&space, ranges, window + 1, 8, 64));
+    vector<bool> alive(data.n, false);
+    for (size_t i = 0; i < window; i++) {
+        index->Insert(data.row(i), data.labels[i], data.payloads[i]);
+        alive[i] = true;
+    }
+
+    // An element moved into the oldest slot may still be linked from the
+    // lists of its former slot, so its id is not reused
+    const size_t moved = window / num_slots;
+    data.payloads[moved] = 5;
+    index->UpdatePayload(data.labels[moved], data.payloads[moved]);
+    CHECK(index->RetireOldestSlot(10 * window + width) ==
+          window / num_slots + 1);
+    for (size_t i = 0; i <= moved; i++) alive[i] = false;
+    CHECK(index->get_free_count() == window / num_slots);
+    Results before = search(*index, queries);
+    CHECK(all_alive(alive, before));
+
+    unique_ptr<Index> loaded(
+        save_and_load(*index, &space, "hsig_test_slot_retirement.bin"));
+    CHECK(loaded->get_free_count() == window / num_slots);
+    CHECK(loaded->get_deleted_count() == 0);
+    CHECK(search(*loaded, queries) == before);
+
+    // A retired label inserted again is a new element
+    const size_t again = 1;
+    data.payloads[again] = 10 * window + 5;
+    loaded->Insert(data.row(again), data.labels[again], data.payloads[again]);
+    alive[again] = true;
+    CHECK(loaded->get_free_count() == window / num_slots - 1);
+    CHECK(loaded->get_deleted_count() == 0);
+    CHECK(loaded->get_current_count() == window);
+
+    for (size_t i = window; i < data.n; i++) {
+        loaded->Insert(data.row(i), data.labels[i], data.payloads[i]);
+        alive[i] = true;
+    }
+    CHECK(loaded->get_free_count() == 0);
+    CHECK(loaded->get_current_count() == window + 1);
+    Results after = search(*loaded, queries);
+    CHECK(all_alive(alive, after));
+    CHECK(recall(data, alive, queries, after) >= 0.9);
+    CHECK(recall(data, alive, queries, search(*loaded, queries, true)) == 1.0);
+
+    // The consolidation drops the id kept out of reuse
+    loaded->ConsolidateDeletions();
+    CHECK(loaded->get_current_count() == window);
+    CHECK(search(*loaded, queries) == after);
+}
+
+// A bulk load gives an index as good as the insertions one by one, which
+// survives a round trip
+void test_bulk_load() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+    index.InsertBatch(data.vectors.data(), data.labels.data(),
+                      data.payloads.data(), data.n);
+    CHECK(index.get_current_count() == data.n);
+    vector<bool> alive(data.n, true);
+    Results results = search(index, queries);
+    CHECK(recall(data, alive, queries, results) >= 0.9);
+    CHECK(recall(data, alive, queries, search(index, queries, true)) == 1.0);
+
+    unique_ptr<Index> loaded(
+        save_and_load(index, &space, "hsig_test_bulk_load.bin"));
+    CHECK(search(*loaded, queries) == results);
+}
+
+// A deterministic bulk load gives the same index file whatever the number of
+// threads linking the batches
+void test_parallel_bulk_load() {
+    Dataset data = make_dataset(2000);
+    hannlib::L2Space space(kDim);
+    string files[2];
+    size_t num_threads[2] = {1, 3};
+    for (int i = 0; i < 2; i++) {
+        Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+        index.set_deterministic_build(true);
+        index.InsertBatch(data.vectors.data(), data.labels.data(),
+                          data.payloads.data(), data.n, num_threads[i], 256);
+        string location = "hsig_test_parallel_bulk_load.bin";
+        index.SaveIndex(location);
+        files[i] = read_file(location);
+        remove(location.c_str());
+    }
+    CHECK(!files[0].empty());
+    CHECK(files[0] == files[1]);
+}
+
+// The global links maintained along the insertions are the ones recomputed
+// from scratch, and the same as those of a build deferring them to a final
+// pass, serial or by batches
+void test_deferred_global_links() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    string location = "hsig_test_global_links.bin";
+    for (bool batch : {false, true}) {
+        string files[3];
+        Results results[3];
+        for (int i = 0; i < 3; i++) {
+            Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+            index.set_deterministic_build(true);
+            index.set_defer_global_links(i == 1);
+            if (batch) {
+                index.InsertBatch(data.vectors.data(), data.labels.data(),
+                                  data.payloads.data(), data.n, 3, 256);
+            } else {
+                for (size_t j = 0; j < data.n; j++) {
+                    index.Insert(data.row(j), data.labels[j],
+                                 data.payloads[j]);
+                }
+            }
+            if (i > 0) index.ComputeGlobalLinks(3);
+            results[i] = search(index, queries);
+            index.SaveIndex(location);
+            files[i] = read_file(location);
+            remove(location.c_str());
+        }
+        CHECK(!files[0].empty());
+        CHECK(files[1] == files[0]);
+        CHECK(files[2] == files[0]);
+        CHECK(results[1] == results[0]);
+        CHECK(results[2] == results[0]);
+        vector<bool> alive(data.n, true);
+        CHECK(recall(data, alive, queries, results[0]) >= 0.9);
+    }
+}
+
+// The insertions linking the slots in parallel, searching them jointly or
+// scheduling their effort by slot give searchable indexes; a schedule of the
+// same effort everywhere builds the same index as none, and malformed
+// schedules are rejected
+void test_insertion_modes() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    vector<bool> alive(data.n, true);
+    string location = "hsig_test_insertion_modes.bin";
+    string files[2];
+    for (int mode = 0; mode < 5; mode++) {
+        Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+        index.set_deterministic_build(true);
+        if (mode == 1) index.set_ef_construction_schedule({64});
+        if (mode == 2) index.set_insert_threads(3);
+        if (mode == 3) index.set_joint_insertion_search(true);
+        if (mode == 4) {
+            index.set_ef_construction_schedule({64, 32, 16});
+            vector<size_t> efs(16, 64);
+            efs[3] = 0;
+            bool rejected = false;
+            try {
+                index.set_ef_construction_by_slots(efs);
+            } catch (const runtime_error&) {
+                rejected = true;
+            }
+            CHECK(rejected);
+            rejected = false;
+            try {
+                index.set_ef_construction_by_slots(vector<size_t>(9, 64));
+            } catch (const runtime_error&) {
+                rejected = true;
+            }
+            CHECK(rejected);
+            rejected = false;
+            try {
+                index.set_ef_construction_schedule({64, 0});
+            } catch (const runtime_error&) {
+                rejected = true;
+            }
+            CHECK(rejected);
+        }
+        for (size_t i = 0; i < data.n; i++) {
+            index.Insert(data.row(i), data.labels[i], data.payloads[i]);
+        }
+        CHECK(index.get_current_count() == data.n);
+        CHECK(recall(data, alive, queries, search(index, queries)) >= 0.9);
+        CHECK(recall(data, alive, queries, search(index, queries, true)) ==
+              1.0);
+        if (mode < 2) {
+            index.SaveIndex(location);
+            files[mode] = read_file(location);
+            remove(location.c_str());
+        }
+    }
+    CHECK(!files[0].empty());
+    CHECK(files[1] == files[0]);
+}
+
+// The NN-Descent build gives a searchable index, which survives a round trip
+void test_nn_descent() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+    index.BuildByNNDescent(data.vectors.data(), data.labels.data(),
+                           data.payloads.data(), data.n, 2);
+    CHECK(index.get_current_count() == data.n);
+    vector<bool> alive(data.n, true);
+    Results results = search(index, queries);
+    CHECK(recall(data, alive, queries, results) >= 0.9);
+    CHECK(recall(data, alive, queries, search(index, queries, true)) == 1.0);
+
+    unique_ptr<Index> loaded(
+        save_and_load(index, &space, "hsig_test_nn_descent.bin"));
+    CHECK(search(*loaded, queries) == results);
+}
+
+// The pruning alphas are saved with the index, and the loaded index links
+// the next points as the original one
+void test_pruning_alphas() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+    index.set_prune_alpha(1.2f);
+    index.set_global_prune_alpha(1.3f);
+    index.set_deterministic_build(true);
+    for (size_t i = 0; i < data.n; i += 2) {
+        index.Insert(data.row(i), data.labels[i], data.payloads[i]);
+    }
+    bool rejected = false;
+    try {
+        index.set_prune_alpha(0.5f);
+    } catch (const runtime_error&) {
+        rejected = true;
+    }
+    CHECK(rejected);
+
+    unique_ptr<Index> loaded(
+        save_and_load(index, &space, "hsig_test_pruning_alphas.bin"));
+    CHECK(loaded->get_prune_alpha() == 1.2f);
+    CHECK(loaded->get_global_prune_alpha() == 1.3f);
+    CHECK(search(*loaded, queries) == search(index, queries));
+
+    loaded->set_deterministic_build(true);
+    for (size_t i = 1; i < data.n; i += 2) {
+        index.Insert(data.row(i), data.labels[i], data.payloads[i]);
+        loaded->Insert(data.row(i), data.labels[i], data.payloads[i]);
+    }
+    string location = "hsig_test_pruning_alphas.bin";
+    index.SaveIndex(location);
+    string original = read_file(location);
+    loaded->SaveIndex(location);
+    CHECK(read_file(location) == original);
+    remove(location.c_str());
+}
+
+// The searches skipping neighbors by the stored link distances find the same
+// points as without skipping, after vectors are replaced in place, and after
+// the consolidation recomputes the distances
+void test_link_distance_upserts() {
+    Dataset data = make_dataset(2000);
+    Dataset moved = make_dataset(2000, 2);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    unique_ptr<Index> index(build_index(&space, data));
+    index->EnableLinkDistances(true);
+    for (size_t i = 0; i < data.n; i += 3) {
+        index->Insert(moved.row(i), data.labels[i], data.payloads[i]);
+        copy(moved.row(i), moved.row(i) + kDim,
+             data.vectors.begin() + i * kDim);
+    }
+
+    for (int step = 0; step < 2; step++) {
+        index->EnableLinkDistances(false);
+        Results exact = search(*index, queries);
+        index->EnableLinkDistances(true);
+        CHECK(search(*index, queries) == exact);
+        vector<bool> alive(data.n, true);
+        CHECK(recall(data, alive, queries, exact) >= 0.9);
+        index->ConsolidateDeletions();
+    }
+}
+
+// Searches running during concurrent insertions only find inserted points in
+// their ranges, and the index is as good as a serial build afterwards
+void test_concurrent_insert_search() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+    index.set_ef(64);
+    vector<atomic<bool>> started(data.n);
+    for (size_t i = 0; i < data.n / 4; i++) {
+        started[i] = true;
+        index.Insert(data.row(i), data.labels[i], data.payloads[i]);
+    }
+
+    atomic<size_t> next(data.n / 4);
+    atomic<bool> done(false), valid(true);
+    vector<thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([&] {
+            for (size_t i; (i = next++) < data.n;) {
+                started[i] = true;
+                index.Insert(data.row(i), data.labels[i], data.payloads[i]);
+            }
+        });
+    }
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([&, t] {
+            for (size_t q = 0; !done; q = (q + 1) % kNumQueries) {
+                const float* query = queries.vectors.data() + q * kDim;
+                const auto& range = queries.ranges[q];
+                auto found = t == 0 ? index.HybridFiltering(query, kK, range)
+                                    : index.PreFiltering(query, kK, range);
+                for (; !found.empty(); found.pop()) {
+                    hannlib::labeltype label = found.top().second;
+                    if (label >= data.n || !started[label] ||
+                        data.payloads[label] < range.first ||
+                        data.payloads[label] > range.second) {
+                        valid = false;
+                    }
+                }
+            }
+        });
+    }
+    for (int t = 0; t < 2; t++) threads[t].join();
+    done = true;
+    for (size_t t = 2; t < threads.size(); t++) threads[t].join();
+
+    CHECK(valid);
+    CHECK(index.get_current_count() == data.n);
+    vector<bool> alive(data.n, true);
+    CHECK(recall(data, alive, queries, search(index, queries)) >= 0.9);
+    CHECK(recall(data, alive, queries, search(index, queries, true)) == 1.0);
+}
+
+// Elements enqueued concurrently into the ingestion queue are all inserted by
+// the flush, the watermark covering them, and a failed insertion is reported
+// by the flush
+void test_ingestion_queue() {
+    Dataset data = make_dataset(2000);
+    Queries queries = make_queries(data);
+    hannlib::L2Space space(kDim);
+    Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+    hannlib::WorkerPool pool(3);
+    hannlib::IngestionQueue<float, hannlib::ScalarRangeExtension> queue(
+        &index, space.get_data_size(), 2, 16);
+    vector<size_t> seqs(data.n);
+    pool.ParallelFor(0, data.n, [&](size_t i) {
+        seqs[i] = queue.Enqueue(data.row(i), data.labels[i], data.payloads[i]);
+    });
+    queue.WaitFor(data.n / 2);
+    CHECK(queue.IsSearchable(data.n / 2));
+    CHECK(queue.GetSearchableWatermark() + queue.GetPendingCount() == data.n);
+    queue.Flush();
+    sort(seqs.begin(), seqs.end());
+    for (size_t i = 0; i < data.n; i++) CHECK(seqs[i] == i + 1);
+    CHECK(queue.GetSearchableWatermark() == data.n);
+    CHECK(queue.GetPendingCount() == 0);
+    CHECK(index.get_current_count() == data.n);
+    vector<bool> alive(data.n, true);
+    CHECK(recall(data, alive, queries, search(index, queries)) >= 0.9);
+
+    // The index is full, so a new label cannot be inserted
+    size_t seq = queue.Enqueue(data.row(0), data.n, data.payloads[0]);
+    bool reported = false;
+    try {
+        queue.Flush();
+    } catch (const runtime_error&) {
+        reported = true;
+    }
+    CHECK(reported);
+    CHECK(queue.IsSearchable(seq));
+    queue.Flush();
+}
+
+// Resuming a bulk load from its last checkpoint, written before the end of
+// the load, gives the same index file as the uninterrupted load, serial or by
+// batches, whatever the number of threads of the resumed load
+void test_checkpoint_resume() {
+    Dataset data = make_dataset(2000);
+    hannlib::L2Space space(kDim);
+    string checkpoint = "hsig_test_checkpoint.bin";
+    string location = "hsig_test_checkpoint_index.bin";
+    struct Build {
+        bool deterministic;
+        size_t num_threads, resume_threads;
+    };
+    for (Build build : {Build{false, 1, 3}, Build{true, 3, 1}}) {
+        Index index(&space, make_slot_ranges(data, 4), data.n, 8, 64);
+        index.set_deterministic_build(build.deterministic);
+        index.set_checkpoint(checkpoint, 300);
+        index.InsertBatch(data.vectors.data(), data.labels.data(),
+                          data.payloads.data(), data.n, build.num_threads,
+                          256);
+        index.SaveIndex(location);
+        string uninterrupted = read_file(location);
+
+        Index resumed(&space, checkpoint, false, data.n);
+        CHECK(read_file(checkpoint) != uninterrupted);
+        resumed.ResumeInsertBatch(build.resume_threads);
+        resumed.SaveIndex(location);
+        CHECK(read_file(location) == uninterrupted);
+        remove(checkpoint.c_str());
+        remove(location.c_str());
+    }
+}
+
+}  // namespace
+
+int main() {
+    test_tombstones();
+    test_payload_update();
+    test_consolidation();
+    test_slot_retirement();
+    test_bulk_load();
+    test_parallel_bulk_load();
+    test_deferred_global_links();
+    test_insertion_modes();
+    test_nn_descent();
+    test_pruning_alphas();
+    test_link_distance_upserts();
+    test_ingestion_queue();
+    test_concurrent_insert_search();
+    test_checkpoint_resume();
+
+    if (failures > 0) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}
@@ -10,6 +10,7 @@
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <memory>
 #include <omp.h>
 
 #include "../hannlib/api.h"
@@ -23,6 +24,19 @@ using namespace std::chrono;
 
 const int QUERY_K = 10;
 
+// Opens a vecs file and checks all its headers, printing the error if any
+template <typename T>
+unique_ptr<fanns_io::VecsView<T>> open_vecs(const string& filename) {
+    try {
+        unique_ptr<fanns_io::VecsView<T>> view(new fanns_io::VecsView<T>(filename));
+        view->check_dims();
+        return view;
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return nullptr;
+    }
+}
+
 int main(int argc, char** argv) {
     if (argc != 11) {
         cerr << "Usage: " << argv[0] << " --query_path <query.fvecs> "
@@ -76,13 +90,21 @@ int main(int argc, char** argv) {
 
     // ========== DATA LOADING (NOT TIMED) ==========
     cout << "\nLoading queries..." << endl;
-    vector<vector<float>> queries = read_fvecs(query_path);
+    unique_ptr<fanns_io::VecsView<float>> queries_view = open_vecs<float>(query_path);
+    if (!queries_view) return 1;
+    const fanns_io::VecsView<float>& queries = *queries_view;
     int num_queries = queries.size();
     int dim = queries.empty() ? 0 : queries[0].size();
     cout << "Loaded " << num_queries << " queries of dimension " << dim << endl;
 
     // Load query ranges (format: "low-high" per line, e.g., "10-50")
-    vector<pair<int, int>> query_ranges = read_two_ints_per_line(query_ranges_file);
+    vector<pair<int, int>> query_ranges;
+    try {
+        query_ranges = fanns_io::parse_ranges_per_line(query_ranges_file);
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
     if (query_ranges.size() != num_queries) {
         cerr << "Error: Number of query ranges (" << query_ranges.size() 
              << ") != number of queries (" << num_queries << ")\n";
@@ -91,7 +113,9 @@ int main(int argc, char** argv) {
     cout << "Loaded " << query_ranges.size() << " query ranges" << endl;
 
     // Load groundtruth
-    vector<vector<int>> groundtruth = read_ivecs(groundtruth_file);
+    unique_ptr<fanns_io::VecsView<int>> groundtruth_view = open_vecs<int>(groundtruth_file);
+    if (!groundtruth_view) return 1;
+    const fanns_io::VecsView<int>& groundtruth = *groundtruth_view;
     if (groundtruth.size() != num_queries) {
         cerr << "Error: Number of groundtruth entries (" << groundtruth.size() 
              << ") != number of queries (" << num_queries << ")\n";